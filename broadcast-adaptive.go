@@ -0,0 +1,189 @@
+package main
+
+import (
+	"sort"
+	"time"
+)
+
+const (
+	// A viewer is considered to be falling behind if this many frames were waiting
+	// for it at once. (About a second of 60 fps video with audio.)
+	adaptiveLagThreshold = 120
+	// After this many consecutive reads with the viewer falling behind,
+	// it is moved to a lower rendition.
+	adaptiveLagStrikes = 3
+	// After keeping up with the stream for this long, the viewer is moved to
+	// a higher rendition (if there is one.)
+	adaptiveUpgradeDelay = 30 * time.Second
+	// If the other rendition has no keyframes for this long, forget about it.
+	adaptiveSwitchTimeout = 10 * time.Second
+)
+
+// Streams named `name@N`, where N is a number (normally the height of the video), are
+// renditions of the stream `name` at a lower bitrate. Higher N means better quality;
+// `name` itself is the best. Returns `name` and N, or -1 for the original stream.
+func splitRendition(id string) (string, int) {
+	for i := len(id) - 1; i >= 0; i-- {
+		if id[i] == '@' && i != len(id)-1 {
+			n := 0
+			for _, c := range []byte(id[i+1:]) {
+				n = n*10 + int(c-'0')
+			}
+			return id[:i], n
+		}
+		if id[i] < '0' || id[i] > '9' || len(id)-i > 9 {
+			break
+		}
+	}
+	return id, -1
+}
+
+// Must be called with a write lock on the shard.
+func (shard *broadcastSetShard) addRendition(id string, cast *Broadcast) {
+	base, n := splitRendition(id)
+	cast.rendition = n
+	// Viewers may still have the old slice, so this must be a copy.
+	group := append(append([]*Broadcast{}, shard.renditions[base]...), cast)
+	sort.Slice(group, func(i, j int) bool {
+		a, b := group[i].rendition, group[j].rendition
+		return a == -1 || (b != -1 && a > b)
+	})
+	shard.renditions[base] = group
+}
+
+// Must be called with a write lock on the shard.
+func (shard *broadcastSetShard) removeRendition(id string, cast *Broadcast) {
+	base, _ := splitRendition(id)
+	group := shard.renditions[base]
+	for i := range group {
+		if group[i] == cast {
+			// Viewers may still have the old slice, so this must be a copy.
+			group = append(append([]*Broadcast{}, group[:i]...), group[i+1:]...)
+			break
+		}
+	}
+	if len(group) == 0 {
+		delete(shard.renditions, base)
+	} else {
+		shard.renditions[base] = group
+	}
+}
+
+// All live renditions of a stream, from best to worst.
+func (ctx *BroadcastSet) Renditions(id string) []*Broadcast {
+	base, _ := splitRendition(id)
+	shard := ctx.shard(base)
+	shard.RLock()
+	group := shard.renditions[base]
+	shard.RUnlock()
+	return group
+}
+
+// A viewer that moves between the renditions of a stream depending on whether
+// it can keep up with the one it is currently watching.
+type adaptiveViewer struct {
+	*viewer
+	set *BroadcastSet
+	id  string
+	// The rendition to move to once it has a keyframe after `pendingSince`.
+	pending      *viewer
+	pendingSince uint64
+	pendingAt    time.Time
+	strikes      int
+	resyncs      int
+	keepingUp    time.Time
+}
+
+// Start watching a stream. If `id` names the original stream rather than a specific
+// rendition, the viewer will switch between renditions as needed.
+func (ctx *BroadcastSet) Connect(id string, cast *Broadcast) *adaptiveViewer {
+	return &adaptiveViewer{viewer: cast.Connect(false), set: ctx, id: id, keepingUp: time.Now()}
+}
+
+func (av *adaptiveViewer) Disconnect() {
+	av.cast.Disconnect(av.viewer)
+	if av.pending != nil {
+		av.pending.cast.Disconnect(av.pending)
+	}
+}
+
+func (av *adaptiveViewer) Read(out [][]byte) ([][]byte, bool) {
+	out, ok := av.viewer.Read(out)
+	if !ok {
+		return out, ok
+	}
+	if _, n := splitRendition(av.id); n != -1 {
+		return out, ok // asked for this rendition specifically
+	}
+
+	if av.viewer.lag >= adaptiveLagThreshold || av.viewer.resyncs != av.resyncs {
+		av.strikes++
+		av.keepingUp = time.Now()
+	} else {
+		av.strikes = 0
+	}
+	av.resyncs = av.viewer.resyncs
+
+	if av.pending == nil {
+		if av.strikes >= adaptiveLagStrikes {
+			av.prepareSwitch(+1)
+		} else if time.Since(av.keepingUp) > adaptiveUpgradeDelay {
+			av.keepingUp = time.Now()
+			av.prepareSwitch(-1)
+		}
+	} else if time.Since(av.pendingAt) > adaptiveSwitchTimeout {
+		av.pending.cast.Disconnect(av.pending)
+		av.pending = nil
+	} else if av.pending.SeekKeyframe(av.pendingSince) {
+		// This is a new Segment, so it needs the track info, but not the EBML header.
+		// See `viewer.skipHeaders` for the codec caveat.
+		av.cast.Disconnect(av.viewer)
+		av.viewer, av.pending = av.pending, nil
+		av.strikes, av.resyncs = 0, av.viewer.resyncs
+		av.keepingUp = time.Now()
+		out = append(out, av.viewer.Tracks())
+	}
+	return out, ok
+}
+
+// Start following the next rendition in the given direction (+1 is worse, -1 is better.)
+// The actual switch happens once it has a keyframe, so that there are no gaps.
+func (av *adaptiveViewer) prepareSwitch(direction int) {
+	group := av.set.Renditions(av.id)
+	for i := range group {
+		if group[i] == av.cast {
+			if i += direction; i >= 0 && i < len(group) {
+				av.pending = group[i].Connect(true)
+				av.pending.SelectTracks(av.viewer.filter)
+				av.pendingSince = group[i].Head()
+				av.pendingAt = time.Now()
+			}
+			return
+		}
+	}
+}
+
+// Move the cursor to the last keyframe, if there has been one since the frame `since`.
+func (cb *viewer) SeekKeyframe(since uint64) bool {
+	cb.cast.vlock.RLock()
+	defer cb.cast.vlock.RUnlock()
+	if seq, ok := cb.cast.frames.LastKeyframe(); ok && seq >= since {
+		cb.cursor = seq
+		return true
+	}
+	return false
+}
+
+// The sequence number of the frame that will be pushed next.
+func (cast *Broadcast) Head() uint64 {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return cast.frames.next
+}
+
+// The beginning of the current Segment: its header, Info, and Tracks.
+func (cast *Broadcast) Tracks() []byte {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return cast.joinTracks
+}
@@ -0,0 +1,135 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func testWrite(t *testing.T, cast *Broadcast, data ...[]byte) {
+	for _, d := range data {
+		if _, err := cast.Write(d); err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
+// Both renditions are live, but only `best` has had a keyframe.
+func testRenditions(t *testing.T) (*BroadcastSet, *Broadcast, *Broadcast) {
+	set := testBroadcastSet()
+	best, _ := set.Writable("test")
+	worst, _ := set.Writable("test@360")
+	testWrite(t, best, testStreams[0].cluster(0), testBlock(1, 0, true, testKeyframeSize))
+	testWrite(t, worst, testStreams[0].cluster(0))
+	return set, best, worst
+}
+
+func testRead(t *testing.T, av *adaptiveViewer) [][]byte {
+	out, ok := av.Read(nil)
+	if !ok {
+		t.Fatal("the stream has ended")
+	}
+	return out
+}
+
+func testHasKeyframe(out [][]byte) bool {
+	for _, buf := range out {
+		if len(buf) == len(testBlock(1, 0, true, testKeyframeSize)) {
+			return true
+		}
+	}
+	return false
+}
+
+func TestAdaptiveDowngrade(t *testing.T) {
+	set, best, worst := testRenditions(t)
+	av := set.Connect("test", best)
+	defer av.Disconnect()
+	testRead(t, av)
+	for i := 0; i < adaptiveLagStrikes; i++ {
+		if av.pending != nil {
+			t.Fatalf("preparing to switch after %d strikes", i)
+		}
+		for j := 0; j < adaptiveLagThreshold; j++ {
+			testWrite(t, best, testBlock(1, 1, false, testFrameSize))
+		}
+		testRead(t, av)
+	}
+	if av.pending == nil || av.pending.cast != worst {
+		t.Fatal("not switching to the lower rendition")
+	}
+
+	// Switching now would mean starting from a frame that cannot be decoded.
+	testWrite(t, worst, testBlock(2, 0, true, testAudioSize), testBlock(1, 0, false, testFrameSize))
+	testWrite(t, best, testBlock(1, 2, false, testFrameSize))
+	testRead(t, av)
+	if av.cast != best {
+		t.Fatal("switched before the lower rendition had a keyframe")
+	}
+
+	testWrite(t, worst, testBlock(1, 33, true, testKeyframeSize))
+	testWrite(t, best, testBlock(1, 3, false, testFrameSize))
+	out := testRead(t, av)
+	if av.cast != worst || av.pending != nil {
+		t.Fatal("did not switch at the keyframe")
+	}
+	if tracks := out[len(out)-1]; &tracks[0] != &worst.Tracks()[0] {
+		t.Fatal("the new Segment does not start with track info")
+	}
+	if out = testRead(t, av); !testHasKeyframe(out) {
+		t.Fatal("the lower rendition did not start from its keyframe")
+	}
+}
+
+func TestAdaptiveUpgrade(t *testing.T) {
+	set, best, worst := testRenditions(t)
+	testWrite(t, worst, testBlock(1, 0, true, testKeyframeSize))
+	av := set.Connect("test", worst)
+	defer av.Disconnect()
+	testRead(t, av)
+	testWrite(t, worst, testBlock(1, 1, false, testFrameSize))
+	testRead(t, av)
+	if av.pending != nil {
+		t.Fatal("preparing to switch right away")
+	}
+
+	av.keepingUp = time.Now().Add(-adaptiveUpgradeDelay)
+	testWrite(t, worst, testBlock(1, 2, false, testFrameSize))
+	testRead(t, av)
+	if av.pending == nil || av.pending.cast != best {
+		t.Fatal("not switching to the higher rendition after keeping up")
+	}
+
+	// `best` has had a keyframe, but nothing since the switch was decided.
+	testWrite(t, best, testBlock(1, 1, false, testFrameSize))
+	testWrite(t, worst, testBlock(1, 3, false, testFrameSize))
+	testRead(t, av)
+	if av.cast != worst {
+		t.Fatal("switched to a keyframe from before the switch")
+	}
+
+	testWrite(t, best, testBlock(1, 33, true, testKeyframeSize))
+	testWrite(t, worst, testBlock(1, 4, false, testFrameSize))
+	testRead(t, av)
+	if av.cast != best {
+		t.Fatal("did not switch at the keyframe")
+	}
+	if out := testRead(t, av); !testHasKeyframe(out) {
+		t.Fatal("the higher rendition did not start from its keyframe")
+	}
+}
+
+// Viewers that ask for a rendition by name stay on it, however far behind they are.
+func TestAdaptiveFixedRendition(t *testing.T) {
+	set, _, worst := testRenditions(t)
+	av := set.Connect("test@360", worst)
+	defer av.Disconnect()
+	for i := 0; i < 2*adaptiveLagStrikes; i++ {
+		for j := 0; j < adaptiveLagThreshold; j++ {
+			testWrite(t, worst, testBlock(1, 1, false, testFrameSize))
+		}
+		testRead(t, av)
+	}
+	if av.pending != nil {
+		t.Fatal("switching away from a rendition that was asked for")
+	}
+}
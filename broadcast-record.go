@@ -0,0 +1,369 @@
+package main
+
+import (
+	"bufio"
+	"errors"
+	"log"
+	"math"
+	"os"
+	"path/filepath"
+	"strconv"
+	"time"
+)
+
+const (
+	// Where recordings are written; they are then served as `/static/recorded/<path>`.
+	recordingDir = "static/recorded"
+	// Recordings are written in chunks of this size, with one syscall each.
+	recordingBufferSize = 1024 * 1024
+	// Space left at the start of the Segment for a SeekHead pointing at Info, Tracks, and Cues.
+	recordingSeekHeadSpace = 96
+)
+
+type recordingCue struct {
+	timecode uint64
+	track    uint64
+	position uint64 // of the Cluster, relative to the start of Segment's contents
+}
+
+// A WebM file that is made seekable once the stream ends. Live streams have neither
+// Cues nor Duration, and their Segments have no length, so space for all of that
+// is reserved while writing, then filled in by `Finish`.
+type recordingWriter struct {
+	f    *os.File
+	out  *bufio.Writer
+	size int64
+	// Offsets of things that `Finish` will overwrite.
+	segment  int64 // start of the Segment's contents; the 8-byte length is right before it
+	info     int64
+	tracks   int64
+	duration int64 // a Void in the Info
+	// Keyframes that start a Cluster, which is where players can begin decoding.
+	videoTracks  uint32
+	cues         []recordingCue
+	cluster      int64 // of the last Cluster header if no blocks have been written after it yet
+	timecode     uint64
+	timecodeBase uint64
+	timecodeLast uint64
+}
+
+func newRecordingWriter(f *os.File) *recordingWriter {
+	return &recordingWriter{f: f, out: bufio.NewWriterSize(f, recordingBufferSize), cluster: -1, timecodeBase: math.MaxUint64}
+}
+
+func (r *recordingWriter) write(data ...[]byte) error {
+	for _, chunk := range data {
+		if _, err := r.out.Write(chunk); err != nil {
+			return err
+		}
+		r.size += int64(len(chunk))
+	}
+	return nil
+}
+
+// Write the EBML header and the beginning of the Segment (Info and Tracks, as sent by a viewer.)
+func (r *recordingWriter) writeHeader(header []byte, segment []byte) error {
+	// Streams that never had a Segment have no track info either, so don't bother.
+	if tag := ebmlParseTagIncomplete(segment); tag.ID != ebmlTagSegment || tag.Consumed != 5 {
+		return errors.New("the stream has no Segment")
+	}
+	seekHead := make([]byte, recordingSeekHeadSpace)
+	seekHead[0], seekHead[1] = ebmlTagVoid, 0x80|byte(recordingSeekHeadSpace-2)
+	err := r.write(header, []byte{
+		ebmlTagSegment >> 24 & 0xFF, ebmlTagSegment >> 16 & 0xFF, ebmlTagSegment >> 8 & 0xFF, ebmlTagSegment & 0xFF,
+		0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // indeterminate for now
+	})
+	if err != nil {
+		return err
+	}
+	r.segment = r.size
+	if err = r.write(seekHead); err != nil {
+		return err
+	}
+
+	for rest := segment[5:]; len(rest) != 0; {
+		tag := ebmlParseTagIncomplete(rest)
+		if tag.Consumed == 0 {
+			break
+		}
+		if tag.ID == ebmlTagTracks {
+			// The TrackEntries follow it; see `Broadcast.parse`.
+			r.tracks = r.size - r.segment
+			err = r.write(rest[:tag.Consumed])
+			rest = rest[tag.Consumed:]
+			continue
+		}
+		if tag = ebmlParseTag(rest); tag.Consumed == 0 {
+			break
+		}
+		switch tag.ID {
+		case ebmlTagInfo:
+			// Same contents, plus a Void large enough for an 8-byte float Duration.
+			contents := tag.Contents(rest)
+			length := uint64(len(contents)) + 11
+			r.info = r.size - r.segment
+			err = r.write([]byte{
+				ebmlTagInfo >> 24 & 0xFF, ebmlTagInfo >> 16 & 0xFF, ebmlTagInfo >> 8 & 0xFF, ebmlTagInfo & 0xFF,
+				0x01, byte(length >> 48), byte(length >> 40), byte(length >> 32),
+				byte(length >> 24), byte(length >> 16), byte(length >> 8), byte(length),
+			}, contents)
+			r.duration = r.size
+			if err == nil {
+				err = r.write([]byte{ebmlTagVoid, 0x80 | 9, 0, 0, 0, 0, 0, 0, 0, 0, 0})
+			}
+		case ebmlTagTrackEntry:
+			number, video := uint64(0), false
+			for buf := tag.Contents(rest); len(buf) != 0; {
+				tag2 := ebmlParseTag(buf)
+				if tag2.Consumed == 0 {
+					break
+				}
+				switch tag2.ID {
+				case ebmlTagTrackNumber:
+					number = fixedUint(tag2.Contents(buf))
+				case ebmlTagVideo:
+					video = true
+				}
+				buf = tag2.Skip(buf)
+			}
+			if video && number < 32 {
+				r.videoTracks |= 1 << number
+			}
+			err = r.write(rest[:uint64(tag.Consumed)+tag.Length])
+		default:
+			err = r.write(rest[:uint64(tag.Consumed)+tag.Length])
+		}
+		if err != nil {
+			return err
+		}
+		rest = tag.Skip(rest)
+	}
+	return nil
+}
+
+// Write a Cluster header or a block, remembering where the keyframes are.
+func (r *recordingWriter) writeChunk(chunk []byte) error {
+	if len(chunk) == 15 && fixedUint(chunk[:4]) == ebmlTagCluster {
+		// See `Broadcast.parse` for the layout.
+		r.cluster = r.size - r.segment
+		r.timecode = fixedUint(chunk[7:])
+		if r.timecode < r.timecodeBase {
+			r.timecodeBase = r.timecode
+		}
+	} else if tag := ebmlParseTag(chunk); tag.ID == ebmlTagSimpleBlock || tag.ID == ebmlTagBlockGroup {
+		block, key := tag.Contents(chunk), false
+		if tag.ID == ebmlTagBlockGroup {
+			// Same as in `Broadcast.parse`.
+			block, key = nil, true
+			for buf := tag.Contents(chunk); len(buf) != 0; {
+				tag2 := ebmlParseTag(buf)
+				if tag2.Consumed == 0 {
+					break
+				}
+				switch tag2.ID {
+				case ebmlTagBlock:
+					block = tag2.Contents(buf)
+				case ebmlTagReferenceBlock:
+					key = fixedUint(tag2.Contents(buf)) == 0
+				}
+				buf = tag2.Skip(buf)
+			}
+		}
+		if track, consumed := ebmlUint(block); consumed != 0 && len(block) >= consumed+3 {
+			timecode := r.timecode + uint64(int16(uint16(block[consumed])<<8|uint16(block[consumed+1])))
+			if timecode > r.timecodeLast {
+				r.timecodeLast = timecode
+			}
+			// Audio frames are a fine place to start only if there's no video.
+			key = (key || block[consumed+2]&0x80 != 0) && (r.videoTracks == 0 || r.videoTracks&(1<<track) != 0)
+			if key && r.cluster != -1 {
+				r.cues = append(r.cues, recordingCue{r.timecode, track, uint64(r.cluster)})
+			}
+		}
+		r.cluster = -1
+	} else {
+		r.cluster = -1
+	}
+	return r.write(chunk)
+}
+
+// Append the Cues, then fill in the SeekHead, the Duration, and the Segment's length.
+func (r *recordingWriter) Finish() error {
+	if r.segment == 0 {
+		return r.out.Flush() // nothing was written
+	}
+	cues := r.size - r.segment
+	if len(r.cues) != 0 {
+		length := uint64(len(r.cues)) * 27
+		err := r.write([]byte{
+			ebmlTagCues >> 24 & 0xFF, ebmlTagCues >> 16 & 0xFF, ebmlTagCues >> 8 & 0xFF, ebmlTagCues & 0xFF,
+			0x01, byte(length >> 48), byte(length >> 40), byte(length >> 32),
+			byte(length >> 24), byte(length >> 16), byte(length >> 8), byte(length),
+		})
+		for _, c := range r.cues {
+			if err != nil {
+				break
+			}
+			t, p := c.timecode, c.position
+			err = r.write([]byte{
+				0xBB, 0x80 | 25, // CuePoint
+				0xB3, 0x88, byte(t >> 56), byte(t >> 48), byte(t >> 40), byte(t >> 32), byte(t >> 24), byte(t >> 16), byte(t >> 8), byte(t),
+				0xB7, 0x80 | 13, // CueTrackPositions
+				0xF7, 0x81, byte(c.track),
+				0xF1, 0x88, byte(p >> 56), byte(p >> 48), byte(p >> 40), byte(p >> 32), byte(p >> 24), byte(p >> 16), byte(p >> 8), byte(p),
+			})
+		}
+		if err != nil {
+			return err
+		}
+	}
+	if err := r.out.Flush(); err != nil {
+		return err
+	}
+
+	length := uint64(r.size - r.segment)
+	segment := []byte{
+		0x01, byte(length >> 48), byte(length >> 40), byte(length >> 32),
+		byte(length >> 24), byte(length >> 16), byte(length >> 8), byte(length),
+	}
+	if _, err := r.f.WriteAt(segment, r.segment-8); err != nil {
+		return err
+	}
+
+	seekHead := []byte{ebmlTagSeekHead >> 24 & 0xFF, ebmlTagSeekHead >> 16 & 0xFF, ebmlTagSeekHead >> 8 & 0xFF, ebmlTagSeekHead & 0xFF, 0x80}
+	seek := func(id uint32, p uint64) {
+		seekHead = append(seekHead,
+			0x4D, 0xBB, 0x80|18, // Seek
+			0x53, 0xAB, 0x84, byte(id>>24), byte(id>>16), byte(id>>8), byte(id),
+			0x53, 0xAC, 0x88, byte(p>>56), byte(p>>48), byte(p>>40), byte(p>>32), byte(p>>24), byte(p>>16), byte(p>>8), byte(p),
+		)
+	}
+	if r.info != 0 {
+		seek(ebmlTagInfo, uint64(r.info))
+	}
+	if r.tracks != 0 {
+		seek(ebmlTagTracks, uint64(r.tracks))
+	}
+	if len(r.cues) != 0 {
+		seek(ebmlTagCues, uint64(cues))
+	}
+	seekHead[4] |= byte(len(seekHead) - 5)
+	// Whatever remains of the reserved space is still a Void.
+	seekHead = append(seekHead, ebmlTagVoid, 0x80|byte(recordingSeekHeadSpace-len(seekHead)-2))
+	if _, err := r.f.WriteAt(seekHead, r.segment); err != nil {
+		return err
+	}
+
+	if r.duration != 0 && r.timecodeBase <= r.timecodeLast {
+		d := math.Float64bits(float64(r.timecodeLast - r.timecodeBase))
+		duration := []byte{
+			ebmlTagDuration >> 8, ebmlTagDuration & 0xFF, 0x88,
+			byte(d >> 56), byte(d >> 48), byte(d >> 40), byte(d >> 32), byte(d >> 24), byte(d >> 16), byte(d >> 8), byte(d),
+		}
+		if _, err := r.f.WriteAt(duration, r.duration); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Copy the stream to a file until it ends or `limit` bytes have been written. This
+// reads the stream like a viewer, so if writing stalls, the recording skips ahead
+// to a keyframe instead of holding up the stream.
+func (cast *Broadcast) Record(f *os.File, limit int64) (int64, error) {
+	r := newRecordingWriter(f)
+	// Not `Connect`, as recordings should not count towards `ViewerCount`.
+	cast.vlock.RLock()
+	cb := &viewer{cast: cast, cursor: cast.frames.JoinPoint()}
+	cast.vlock.RUnlock()
+
+	var err error
+	full := false
+	for chunks, ok := cb.Read(nil); ok && err == nil; chunks, ok = cb.Read(chunks[:0]) {
+		if r.segment == 0 {
+			// See `viewer.Read`.
+			if len(chunks) < 2 {
+				err = errors.New("the stream has no header")
+				break
+			}
+			if err = r.writeHeader(chunks[0], chunks[1]); err != nil {
+				break
+			}
+			chunks = chunks[2:]
+		}
+		for _, chunk := range chunks {
+			// Skipping this and writing whatever comes next would leave a gap in the GOP.
+			if full = r.size+int64(len(chunk)) > limit; full || err != nil {
+				break
+			}
+			err = r.writeChunk(chunk)
+		}
+		if full || r.size >= limit {
+			break
+		}
+	}
+	if err != nil {
+		r.out.Flush()
+		return r.size, err
+	}
+	err = r.Finish()
+	return r.size, err
+}
+
+// Record a stream into a new file in `recordingDir`, if its owner has any space left.
+func (ctx *RetransmissionHandler) record(id string, cast *Broadcast) {
+	ctx.recordLock.Lock()
+	if _, ok := ctx.recording[cast]; ok {
+		ctx.recordLock.Unlock()
+		return
+	}
+	ctx.recording[cast] = struct{}{}
+	ctx.recordLock.Unlock()
+
+	go func() {
+		defer func() {
+			ctx.recordLock.Lock()
+			delete(ctx.recording, cast)
+			ctx.recordLock.Unlock()
+		}()
+		// A stream can restart several times a second, but each time needs a new file.
+		path := id + "-" + strconv.FormatInt(time.Now().UTC().UnixNano(), 10) + ".webm"
+		recid, limit, err := ctx.StartRecording(id, path)
+		if err != nil || limit <= 0 {
+			if err != nil {
+				log.Println("Error starting a recording: ", err)
+			}
+			return
+		}
+		size, err := ctx.recordTo(cast, filepath.Join(recordingDir, path), limit)
+		if err != nil {
+			log.Println("Error writing a recording: ", err)
+		}
+		if size == 0 {
+			// Either the file could not be created, or there was nothing to put in it.
+			if err = ctx.DeleteRecording(id, recid); err != nil {
+				log.Println("Error deleting a recording: ", err)
+			}
+		} else if err = ctx.StopRecording(id, recid, size); err != nil {
+			log.Println("Error stopping a recording: ", err)
+		}
+	}()
+}
+
+func (ctx *RetransmissionHandler) recordTo(cast *Broadcast, path string, limit int64) (int64, error) {
+	if err := os.MkdirAll(filepath.Dir(path), 0755); err != nil {
+		return 0, err
+	}
+	f, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	if err != nil {
+		return 0, err
+	}
+	size, err := cast.Record(f, limit)
+	if err2 := f.Close(); err == nil {
+		err = err2
+	}
+	if size == 0 {
+		os.Remove(path)
+	}
+	return size, err
+}
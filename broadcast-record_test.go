@@ -0,0 +1,173 @@
+package main
+
+import (
+	"io/ioutil"
+	"math"
+	"testing"
+)
+
+// Stream 25 fps video with a keyframe every second until `done` is closed. Recordings
+// start from whatever keyframe is the latest one, so there must always be more.
+func testLiveStream(t *testing.T, cast *Broadcast, done <-chan struct{}) <-chan struct{} {
+	stopped := make(chan struct{})
+	go func() {
+		defer close(stopped)
+		for n := uint64(0); ; n++ {
+			select {
+			case <-done:
+				return
+			default:
+			}
+			var data []byte
+			if n%25 == 0 {
+				data = append(testID(nil, ebmlTagCluster), 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+				data = append(data, testUint(ebmlTagTimecode, n*40)...)
+				data = append(data, testBlock(1, 0, true, testKeyframeSize)...)
+			} else {
+				data = testBlock(1, n%25*40, false, testFrameSize)
+			}
+			data = append(data, testBlock(2, n%25*40, true, testAudioSize)...)
+			if _, err := cast.Write(data); err != nil {
+				t.Error(err)
+				return
+			}
+		}
+	}()
+	return stopped
+}
+
+type testRecording struct {
+	duration float64
+	clusters []uint64       // timecodes
+	cues     []recordingCue // `position` is an index into `clusters`
+	cuesAt   int            // in the file
+	last     uint64
+	empty    bool // the last Cluster has no blocks
+}
+
+func testParseRecording(t *testing.T, data []byte) testRecording {
+	rec, segment, cluster := testRecording{duration: -1, cuesAt: -1}, -1, uint64(0)
+	positions := map[uint64]uint64{}
+	for buf := data; len(buf) != 0; {
+		tag := ebmlParseTagIncomplete(buf)
+		if tag.Consumed == 0 || (!tag.IsContainer() && ebmlParseTag(buf).Consumed == 0) {
+			t.Fatalf("malformed EBML at %d", len(data)-len(buf))
+		}
+		at := len(data) - len(buf)
+		switch tag.ID {
+		case ebmlTagSegment:
+			if segment = at + tag.Consumed; tag.Length != uint64(len(data)-segment) {
+				t.Fatalf("the Segment is %d bytes, but %d follow it", tag.Length, len(data)-segment)
+			}
+		case ebmlTagInfo:
+			for info := tag.Contents(buf); len(info) != 0; {
+				tag2 := ebmlParseTag(info)
+				if tag2.ID == ebmlTagDuration {
+					rec.duration = math.Float64frombits(fixedUint(tag2.Contents(info)))
+				}
+				info = tag2.Skip(info)
+			}
+		case ebmlTagCluster:
+			positions[uint64(at-segment)] = uint64(len(rec.clusters))
+			rec.empty = true
+		case ebmlTagTimecode:
+			cluster = fixedUint(tag.Contents(buf))
+			rec.clusters = append(rec.clusters, cluster)
+		case ebmlTagSimpleBlock:
+			block := tag.Contents(buf)
+			rec.empty = false
+			if timecode := cluster + (uint64(block[1])<<8 | uint64(block[2])); timecode > rec.last {
+				rec.last = timecode
+			}
+		case ebmlTagCues:
+			rec.cuesAt = at
+			for cues := tag.Contents(buf); len(cues) != 0; {
+				point := ebmlParseTag(cues)
+				cue := recordingCue{}
+				for fields := point.Contents(cues); len(fields) != 0; {
+					field := ebmlParseTag(fields)
+					switch field.ID {
+					case 0xB3: // CueTime
+						cue.timecode = fixedUint(field.Contents(fields))
+					case 0xB7: // CueTrackPositions
+						fields = fields[field.Consumed:]
+						continue
+					case 0xF7: // CueTrack
+						cue.track = fixedUint(field.Contents(fields))
+					case 0xF1: // CueClusterPosition
+						if n, ok := positions[fixedUint(field.Contents(fields))]; ok {
+							cue.position = n
+						} else {
+							t.Fatal("a cue does not point to a Cluster")
+						}
+					}
+					fields = field.Skip(fields)
+				}
+				rec.cues = append(rec.cues, cue)
+				cues = point.Skip(cues)
+			}
+		}
+		if tag.IsContainer() {
+			buf = buf[tag.Consumed:]
+		} else {
+			buf = tag.Skip(buf)
+		}
+	}
+	return rec
+}
+
+func TestRecord(t *testing.T) {
+	cast, _ := testBroadcastSet().Writable("test")
+	if _, err := cast.Write(testStreams[0].header()); err != nil {
+		t.Fatal(err)
+	}
+	done := make(chan struct{})
+	stopped := testLiveStream(t, cast, done)
+	defer func() {
+		close(done)
+		<-stopped
+	}()
+
+	f, err := ioutil.TempFile(t.TempDir(), "*.webm")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer f.Close()
+	const limit = 1024 * 1024
+	size, err := cast.Record(f, limit)
+	if err != nil {
+		t.Fatal(err)
+	}
+	data, err := ioutil.ReadFile(f.Name())
+	if err != nil {
+		t.Fatal(err)
+	}
+	if int64(len(data)) != size {
+		t.Fatalf("the file is %d bytes, but %d were written", len(data), size)
+	}
+
+	rec := testParseRecording(t, data)
+	// Every block is whole, so the last one that was written must have fit.
+	if rec.cuesAt > limit || rec.cuesAt < limit-testKeyframeSize-32 {
+		t.Fatalf("the recording stopped at %d bytes instead of about %d", rec.cuesAt, limit)
+	}
+	if len(rec.clusters) < 2 {
+		t.Fatalf("only %d Clusters were recorded", len(rec.clusters))
+	}
+	if want := float64(rec.last - rec.clusters[0]); rec.duration != want {
+		t.Fatalf("the Duration is %v, not %v", rec.duration, want)
+	}
+	// Every Cluster starts with a video keyframe; audio is not where video can start.
+	// The keyframe that did not fit may have left the last one empty.
+	if rec.empty {
+		rec.clusters = rec.clusters[:len(rec.clusters)-1]
+	}
+	if len(rec.cues) != len(rec.clusters) {
+		t.Fatalf("%d cues for %d Clusters", len(rec.cues), len(rec.clusters))
+	}
+	for i, cue := range rec.cues {
+		if cue.track != 1 || cue.position != uint64(i) || cue.timecode != rec.clusters[i] {
+			t.Fatalf("cue %d is %+v, not for Cluster %d at %d", i, cue, i, rec.clusters[i])
+		}
+	}
+}
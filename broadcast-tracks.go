@@ -0,0 +1,165 @@
+package main
+
+import (
+	"errors"
+	"strconv"
+	"strings"
+)
+
+// The tracks a viewer wants to receive. The zero value means all of them.
+type trackFilter struct {
+	audio   bool
+	video   bool
+	numbers uint32 // bit vector of TrackNumbers
+}
+
+// Parse a comma-separated list of `audio`, `video`, and track numbers, e.g. `audio`
+// or `video,3`. An empty string selects every track.
+func parseTrackFilter(s string) (trackFilter, error) {
+	f := trackFilter{}
+	if s == "" {
+		return f, nil
+	}
+	for _, name := range strings.Split(s, ",") {
+		switch name {
+		case "audio":
+			f.audio = true
+		case "video":
+			f.video = true
+		default:
+			// `viewer.skipTracks` is a 32-bit vector, like `seenKeyframes`.
+			n, err := strconv.ParseUint(name, 10, 5)
+			if err != nil {
+				return f, errors.New("invalid track selection")
+			}
+			f.numbers |= 1 << n
+		}
+	}
+	return f, nil
+}
+
+func (f trackFilter) keeps(number uint64, audio bool, video bool) bool {
+	return f.numbers&(1<<number) != 0 || (f.audio && audio) || (f.video && video)
+}
+
+// Remove the unwanted TrackEntries from the beginning of a Segment (see `Broadcast.Tracks`.)
+// Returns the new header, a bit vector of the tracks that were removed, and the MIME
+// type of what remains.
+func (f trackFilter) apply(tracks []byte) ([]byte, uint32, string) {
+	out := make([]byte, 0, len(tracks))
+	removed, codecs, hasVideo, size := uint32(0), []string{}, false, -1
+	for buf := tracks; len(buf) != 0; {
+		tag := ebmlParseTagIncomplete(buf)
+		if tag.Consumed == 0 {
+			break
+		}
+
+		switch tag.ID {
+		case ebmlTagSegment:
+			out = append(out, buf[:tag.Consumed]...)
+			buf = buf[tag.Consumed:]
+			continue
+
+		case ebmlTagTracks:
+			// The entries are not all there, so the length has to be recomputed.
+			out = append(out,
+				ebmlTagTracks>>24&0xFF, ebmlTagTracks>>16&0xFF, ebmlTagTracks>>8&0xFF, ebmlTagTracks&0xFF,
+				0x01, 0, 0, 0, 0, 0, 0, 0)
+			size = len(out)
+			buf = buf[tag.Consumed:]
+			continue
+
+		case ebmlTagTrackEntry:
+			if tag = ebmlParseTag(buf); tag.Consumed == 0 {
+				break
+			}
+			number, audio, video, codec := uint64(0), false, false, ""
+			for buf2 := tag.Contents(buf); len(buf2) != 0; {
+				tag2 := ebmlParseTag(buf2)
+				if tag2.Consumed == 0 {
+					break
+				}
+
+				switch tag2.ID {
+				case ebmlTagTrackNumber:
+					number = fixedUint(tag2.Contents(buf2))
+				case ebmlTagCodecID:
+					codec = mseCodecName(string(tag2.Contents(buf2)))
+				case ebmlTagAudio:
+					audio = true
+				case ebmlTagVideo:
+					video = true
+				}
+
+				buf2 = tag2.Skip(buf2)
+			}
+
+			if !f.keeps(number, audio, video) {
+				removed |= 1 << number
+				buf = tag.Skip(buf)
+				continue
+			}
+			codecs = append(codecs, codec)
+			hasVideo = hasVideo || video
+
+		default:
+			tag = ebmlParseTag(buf)
+		}
+
+		if tag.Consumed == 0 {
+			break
+		}
+		out = append(out, buf[:uint64(tag.Consumed)+tag.Length]...)
+		buf = tag.Skip(buf)
+	}
+
+	if size != -1 {
+		for i, n := size-1, len(out)-size; i > size-8; i, n = i-1, n>>8 {
+			out[i] = byte(n)
+		}
+	}
+	mimeType := `video/webm; codecs="`
+	if !hasVideo {
+		mimeType = `audio/webm; codecs="`
+	}
+	return out, removed, mimeType + strings.Join(codecs, ",") + `"`
+}
+
+// Only send the tracks selected by `f`. Must be called before the first `Read`.
+func (cb *viewer) SelectTracks(f trackFilter) {
+	cb.filter = f
+	cb.source = nil
+}
+
+// The beginning of the current Segment, with only the selected tracks.
+// Must be called with a read lock on `vlock`.
+func (cb *viewer) segmentHeader() []byte {
+	joined := cb.cast.joinTracks
+	if cb.filter == (trackFilter{}) || len(joined) == 0 {
+		return joined
+	}
+	// Only a new Segment changes this, and then the track numbers may have changed too.
+	if len(joined) != len(cb.source) || &joined[0] != &cb.source[0] {
+		cb.source = joined
+		cb.tracks, cb.skipTracks, cb.mimeType = cb.filter.apply(joined)
+	}
+	return cb.tracks
+}
+
+// Same as `Broadcast.Tracks`, but for this viewer's selection of tracks.
+func (cb *viewer) Tracks() []byte {
+	cb.cast.vlock.RLock()
+	defer cb.cast.vlock.RUnlock()
+	return cb.segmentHeader()
+}
+
+// Same as `Broadcast.MimeType`, but for this viewer's selection of tracks.
+func (cb *viewer) MimeType() string {
+	cb.cast.vlock.RLock()
+	defer cb.cast.vlock.RUnlock()
+	if cb.segmentHeader(); cb.mimeType == "" {
+		// Nothing has been broadcast yet, so there is nothing to filter.
+		return cb.cast.mimeType
+	}
+	return cb.mimeType
+}
@@ -2,13 +2,22 @@ package main
 
 import (
 	"errors"
+	"math"
+	"runtime"
 	"sync"
+	"sync/atomic"
 	"time"
 )
 
 const (
 	// a special value for a tag's length than means "until the next tag of same level".
 	ebmlIndeterminate = 0xFFFFFFFFFFFFFF
+	// an 8-byte id followed by an 8-byte length.
+	ebmlMaxHeaderLength = 16
+	// anything larger than this is rejected; (Simple)Blocks should be much smaller.
+	ebmlMaxTagLength = 1024 * 1024
+	// frames are copied into chunks of memory this large. see `Broadcast.retain`.
+	ebmlSlabSize = 65536
 	// some of the possible tag ids.
 	// https://www.matroska.org/technical/specs/index.html
 	ebmlTagVoid            = 0xEC
@@ -131,6 +140,11 @@ func ebmlParseTag(data []byte) ebmlTag {
 	return ebmlTag{0, 0, 0}
 }
 
+// Whether this tag's children are parsed as if they were on the same level.
+func (t ebmlTag) IsContainer() bool {
+	return t.ID == ebmlTagSegment || t.ID == ebmlTagTracks || t.ID == ebmlTagCluster
+}
+
 func (t ebmlTag) Contents(data []byte) []byte {
 	return data[t.Consumed : uint64(t.Consumed)+t.Length]
 }
@@ -140,99 +154,237 @@ func (t ebmlTag) Skip(data []byte) []byte {
 }
 
 type frame struct {
-	buf   []byte // Either a Block(Group) or a Cluster.
-	track uint64 // 64 for a Cluster (track masks are 32-bit, so streams with a real 64-th track are rejected)
-	key   bool
+	buf      []byte // A Block(Group).
+	cluster  []byte // The Cluster header. Blocks from the same Cluster share the same slice.
+	track    uint64
+	timecode uint64
+	traced   int64 // When the frame was pushed, if it was sampled for tracing; else 0.
+	key      bool
 }
 
+const (
+	// Frames before the last keyframe are kept a while longer for viewers that are
+	// slightly behind. Those that fall back further than this have to resynchronize.
+	framebufferSlack = 360
+	// Must be a power of 2. The ring grows as needed to fit a whole GOP.
+	framebufferInitialLength = 512
+)
+
+// A ring of recent frames. The broadcaster pushes each frame once, and any number
+// of viewers read it at their own pace. It always holds everything since the last
+// keyframe (unless that is over `limit` bytes), so that new viewers can start
+// decoding right away instead of waiting for the next one.
 type framebuffer struct {
-	data        []frame
-	start       int
-	headCluster []byte // Last Cluster popped off the ring. Blocks at the head still belong to it.
+	data     []frame
+	first    uint64 // Sequence number of the oldest frame still in the buffer.
+	next     uint64 // Sequence number of the frame that will be pushed next.
+	keyframe uint64 // Sequence number of the last keyframe (if `hasKey` and `first <= keyframe`.)
+	hasKey   bool   // Whether there has been a keyframe at all; until then, `keyframe` is 0.
+	size     int    // Total length of all frames in the buffer.
+	limit    int
 }
 
-func (fb *framebuffer) PushCluster(buf []byte) {
-	fb.PushFrame(frame{buf, 64, false})
+func newFramebuffer(limit int) framebuffer {
+	return framebuffer{data: make([]frame, framebufferInitialLength), limit: limit}
 }
 
-func (fb *framebuffer) PushFrame(packed frame) {
-	if len(fb.data) == cap(fb.data) {
-		if fb.data[fb.start].track == 64 {
-			fb.headCluster = fb.data[fb.start].buf
-		}
-		fb.data[fb.start] = packed
-		fb.start = (fb.start + 1) % len(fb.data)
-	} else {
-		fb.data = append(fb.data, packed)
-	}
-}
-
-func (fb *framebuffer) Read(cb func(cluster []byte, forceCluster bool, packed frame)) {
-	cluster, forceCluster := fb.headCluster, true
-	for i, s, n := 0, fb.start, len(fb.data); i < n; i++ {
-		f := fb.data[(i+s)%n]
-		if f.track == 64 {
-			cluster = f.buf
-			forceCluster = true
-		} else if cluster != nil {
-			cb(cluster, forceCluster, f)
-			forceCluster = false
+// Add a frame to the buffer. `Key` should be set for frames new viewers can start from.
+func (fb *framebuffer) Push(packed frame, key bool) {
+	if fb.next-fb.first == uint64(len(fb.data)) {
+		data := make([]frame, len(fb.data)*2)
+		for seq := fb.first; seq != fb.next; seq++ {
+			data[seq&uint64(len(data)-1)] = fb.At(seq)
 		}
+		fb.data = data
+	}
+	if key {
+		fb.keyframe, fb.hasKey = fb.next, true
+	}
+	fb.data[fb.next&uint64(len(fb.data)-1)] = packed
+	fb.next++
+	fb.size += len(packed.buf)
+	for fb.size > fb.limit || (fb.hasKey && fb.first < fb.keyframe && fb.keyframe-fb.first > framebufferSlack) {
+		oldest := &fb.data[fb.first&uint64(len(fb.data)-1)]
+		fb.size -= len(oldest.buf)
+		*oldest = frame{}
+		fb.first++
+	}
+}
+
+func (fb *framebuffer) At(seq uint64) frame {
+	return fb.data[seq&uint64(len(fb.data)-1)]
+}
+
+func (fb *framebuffer) Oldest() uint64 {
+	return fb.first
+}
+
+// Sequence number of the last keyframe, if it is still in the buffer.
+func (fb *framebuffer) LastKeyframe() (uint64, bool) {
+	return fb.keyframe, fb.hasKey && fb.first <= fb.keyframe
+}
+
+// Sequence number of the frame new viewers should start from.
+func (fb *framebuffer) JoinPoint() uint64 {
+	if seq, ok := fb.LastKeyframe(); ok {
+		return seq
 	}
+	// The whole GOP did not fit, so they'll have to wait for the next keyframe.
+	return fb.first
 }
 
 type viewer struct {
-	// This function may return `false` to signal that it cannot write any more data.
-	// The stream will resynchronize at next keyframe.
-	write func(data []byte) bool
+	cast *Broadcast
+	// Sequence number of the next frame to read from `cast.frames`.
+	cursor uint64
 	// Viewers may hop between streams, but should only receive headers once.
 	// This includes track info, as codecs must stay the same between segments.
 	skipHeaders bool
 	// We group blocks into indeterminate-length clusters. So long as
 	// the cluster's timecode has not changed, there's no need to start a new one.
-	skipCluster bool
+	cluster []byte
 	// Bit vector of tracks for which the viewer has both reference frames
 	// (the previous frame and the last keyframe.)
 	seenKeyframes uint32
+	// The tracks the viewer asked for, the `cast.joinTracks` they were last selected
+	// from, and the result. See `SelectTracks`.
+	filter     trackFilter
+	source     []byte
+	tracks     []byte
+	skipTracks uint32
+	mimeType   string
+	// How many frames were waiting to be read on the last call to `Read`, and how many
+	// times the viewer has fallen so far behind that it had to resynchronize.
+	lag     uint64
+	resyncs int
+	// The timecode of the last frame read.
+	timecode uint64
+	// When the oldest traced frame returned by the last `Read` was pushed, and when
+	// it was read. 0 if there were none. See `Sent`.
+	traced int64
+	readAt int64
 }
 
-func (cb *viewer) WriteFrame(cluster []byte, forceCluster bool, packed frame) {
+// Wait until there is something to send, then append it to `out` in the order it should
+// be written. Returns `false` once the stream has ended. The data must not be modified.
+func (cb *viewer) Read(out [][]byte) ([][]byte, bool) {
+	cast := cb.cast
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	for cb.cursor == cast.frames.next && !cast.Closed {
+		cast.vcond.Wait()
+	}
+	if cast.Closed {
+		return out, false
+	}
+	tracks := cb.segmentHeader()
+	if !cb.skipHeaders {
+		out = append(out, cast.joinHeader, tracks)
+		cb.skipHeaders = true
+	}
+	cb.lag = cast.frames.next - cb.cursor
+	cb.traced = 0
+	if cb.cursor < cast.frames.Oldest() {
+		// The frames in between are gone, and so are the reference frames
+		// for whatever comes next. The stream will resynchronize at next keyframe.
+		cb.cursor = cast.frames.JoinPoint()
+		cb.cluster = nil
+		cb.seenKeyframes = 0
+		cb.resyncs++
+		atomic.AddUint64(&metrics.resyncs, 1)
+	}
+	for ; cb.cursor != cast.frames.next; cb.cursor++ {
+		packed := cast.frames.At(cb.cursor)
+		if packed.traced != 0 && cb.traced == 0 {
+			cb.traced = packed.traced
+		}
+		out = cb.WriteFrame(out, packed)
+		cb.timecode = packed.timecode
+	}
+	if cb.traced != 0 {
+		cb.readAt = time.Now().UnixNano()
+		metrics.traceQueue.Observe(time.Duration(cb.readAt - cb.traced))
+	}
+	return out, true
+}
+
+// Called after the data returned by `Read` has been written to the socket.
+func (cb *viewer) Sent() {
+	if cb.traced != 0 {
+		metrics.traceSend.Observe(time.Duration(time.Now().UnixNano() - cb.readAt))
+		cb.traced = 0
+	}
+}
+
+func (cb *viewer) WriteFrame(out [][]byte, packed frame) [][]byte {
 	trackMask := uint32(1) << packed.track
-	if forceCluster {
-		cb.skipCluster = false
+	if cb.skipTracks&trackMask != 0 {
+		return out
 	}
 	if packed.key {
 		cb.seenKeyframes |= trackMask
 	}
 	if cb.seenKeyframes&trackMask != 0 {
-		if !cb.skipCluster {
-			cb.skipCluster = cb.write(cluster)
-		}
-		if !cb.skipCluster || !cb.write(packed.buf) {
-			cb.seenKeyframes &= ^trackMask
+		if len(cb.cluster) == 0 || &cb.cluster[0] != &packed.cluster[0] {
+			out = append(out, packed.cluster)
+			cb.cluster = packed.cluster
 		}
+		out = append(out, packed.buf)
 	}
+	return out
 }
 
-type BroadcastSet struct {
-	mutex   sync.Mutex
+// Viewers look up streams on every connect, so the registry is split into
+// independently locked parts to keep reconnect storms from contending on one mutex.
+const broadcastSetShards = 64
+
+type broadcastSetShard struct {
+	sync.RWMutex
 	streams map[string]*Broadcast
+	// All renditions of a stream are in the same shard. See `splitRendition`.
+	renditions map[string][]*Broadcast
+}
+
+type BroadcastSet struct {
+	shards [broadcastSetShards]broadcastSetShard
+	timers sync.Once
 	// How long to keep a stream alive after a call to `Close`.
 	Timeout time.Duration
+	// How much memory each stream may use to buffer frames for viewers.
+	BufferSize int
+	// Trace the latency of every N-th block. 0 to disable. See `metrics.traceIngest`.
+	TraceEvery uint64
 	// Called right after a stream is destroyed. (`Timeout` seconds after a `Close`.)
 	OnStreamClose     func(id string)
 	OnStreamTrackInfo func(id string, info *StreamTrackInfo)
 }
 
 type Broadcast struct {
+	// These are accessed atomically (and kept first so that they are 64-bit aligned.)
+	// `closing` is how long the stream has been without a writer, -1 if it has one,
+	// or -2 if it has expired.
+	// the rest are for the whole stream, so they include audio and muxing overhead.
+	// the latter is negligible, however, and the former is normally about 64k,
+	// so also negligible. or at least predictable. `rateMean` and `rateVar`
+	// are `math.Float64bits` of bytes per second.
+	closing   int64
+	rateBytes uint64 // received since the last tick
+	rateMean  uint64
+	rateVar   uint64
+	dirty     int32 // (1 if `info` has changed.)
+
 	StreamTrackInfo
-	closing time.Duration
-	Closed  bool
-	dirty   bool // (Has unseen data in `StreamTrackInfo`.)
-	buffer  []byte
-	header  []byte // The EBML (DocType) tag.
-	tracks  []byte // The beginning of the Segment (Tracks + Info).
-	frames  framebuffer
+	Closed    bool
+	rendition int    // See `splitRendition`.
+	buffer    []byte // A tag split between two calls to `Write`. Always at the end of `slab`.
+	slab      []byte // Storage for frames. Read buffers are parsed in place, but frames outlive them.
+	header    []byte // The EBML (DocType) tag.
+	tracks    []byte // The beginning of the Segment (Tracks + Info).
+	cluster   []byte // The header of the Cluster with timecode `sentClusterTimecode`.
+	codecs    string // The `codecs` parameter of the MIME type, as far as it is known.
+	// Bit vector of tracks that contain video. Blocks on these are always used as join
+	// points; others only when there is no video at all.
+	videoTracks uint32
 	// outbound clusters must have monotonically increasing timecodes even if the inbound
 	// stream restarts from the beginning.
 	firstBlockInSegment bool
@@ -240,128 +392,314 @@ type Broadcast struct {
 	sentClusterTimecode uint64
 	recvClusterTimecode uint64
 	timecodeShift       uint64
-	// these values are for the whole stream, so they include audio and muxing overhead.
-	// the latter is negligible, however, and the former is normally about 64k,
-	// so also negligible. or at least predictable.
-	rateUnit float64
-	RateMean float64
-	RateVar  float64
+	// A copy of `BroadcastSet.TraceEvery`, the number of blocks since the last traced one,
+	// and when the current call to `Write` started (if tracing.)
+	traceEvery uint64
+	traceCount uint64
+	writeStart int64
+
+	vlock sync.RWMutex // Protects everything below (and `Closed`).
+	// Signaled after a frame is pushed or the stream is closed. Holds a read lock.
+	vcond  *sync.Cond
+	frames framebuffer
+	// A copy of `StreamTrackInfo` as of the last track entry parsed.
+	info StreamTrackInfo
+	// The same for `codecs`, but as a complete MIME type.
+	mimeType string
+	// The values of `header` and `tracks` as of the last pushed frame.
+	joinHeader []byte
+	joinTracks []byte
+	viewers    map[*viewer]struct{}
+	// See `Snapshot`. `snapshotSeq` is the keyframe's sequence number + 1, or 0 if none.
+	snapshot    []byte
+	snapshotSeq uint64
+	snapshotTag string
+}
 
-	vlock   sync.Mutex
-	viewers map[chan<- []byte]*viewer
+func (ctx *BroadcastSet) shard(id string) *broadcastSetShard {
+	id, _ = splitRendition(id)
+	// 32-bit FNV-1a.
+	h := uint32(2166136261)
+	for i := 0; i < len(id); i++ {
+		h = (h ^ uint32(id[i])) * 16777619
+	}
+	return &ctx.shards[h%broadcastSetShards]
 }
 
 func (ctx *BroadcastSet) Readable(id string) (*Broadcast, bool) {
-	if ctx.streams == nil {
-		return nil, false
-	}
-	ctx.mutex.Lock()
-	cast, ok := ctx.streams[id]
-	ctx.mutex.Unlock()
+	shard := ctx.shard(id)
+	shard.RLock()
+	cast, ok := shard.streams[id]
+	shard.RUnlock()
 	return cast, ok
 }
 
 func (ctx *BroadcastSet) Writable(id string) (*Broadcast, bool) {
-	ctx.mutex.Lock()
-	defer ctx.mutex.Unlock()
-	if ctx.streams == nil {
-		ctx.streams = make(map[string]*Broadcast)
+	shard := ctx.shard(id)
+	shard.Lock()
+	defer shard.Unlock()
+	if shard.streams == nil {
+		shard.streams = make(map[string]*Broadcast)
+		shard.renditions = make(map[string][]*Broadcast)
 	}
-	if cast, ok := ctx.streams[id]; ok {
-		if cast.closing == -1 {
+	if cast, ok := shard.streams[id]; ok {
+		// `Resume` does not take the lock, so this must be the same compare-and-swap.
+		if !cast.Resume() {
 			return nil, false
 		}
-		cast.closing = -1
 		return cast, true
 	}
+	ctx.timers.Do(ctx.startTimers)
 	cast := Broadcast{
 		closing:             -1,
-		frames:              framebuffer{make([]frame, 0, 120), 0, nil},
-		viewers:             make(map[chan<- []byte]*viewer),
+		frames:              newFramebuffer(ctx.BufferSize),
+		viewers:             make(map[*viewer]struct{}),
 		sentClusterTimecode: 0xFFFFFFFFFFFFFFFF,
+		traceEvery:          ctx.TraceEvery,
 	}
-	ctx.streams[id] = &cast
-	go func() {
-		ticker := time.NewTicker(time.Second)
-		for range ticker.C {
-			if cast.dirty {
-				cast.dirty = false
-				ctx.OnStreamTrackInfo(id, &cast.StreamTrackInfo)
-			}
-			if cast.closing >= 0 {
-				if cast.closing += time.Second; cast.closing > ctx.Timeout {
-					break
+	cast.vcond = sync.NewCond(cast.vlock.RLocker())
+	shard.streams[id] = &cast
+	shard.addRendition(id, &cast)
+	return &cast, true
+}
+
+// Per-stream housekeeping (keepalive expiry, rate sampling, and metadata updates)
+// is done once a second by one goroutine per core, each looking after a subset of shards.
+func (ctx *BroadcastSet) startTimers() {
+	n := runtime.GOMAXPROCS(0)
+	if n > broadcastSetShards {
+		n = broadcastSetShards
+	}
+	for i := 0; i < n; i++ {
+		go func(i int) {
+			for range time.Tick(time.Second) {
+				for j := i; j < broadcastSetShards; j += n {
+					ctx.tick(&ctx.shards[j])
 				}
 			}
-			// exponentially weighted moving moments at a = 0.5
-			//     avg[n] = a * x + (1 - a) * avg[n - 1]
-			//     var[n] = a * (x - avg[n]) ** 2 / (1 - a) + (1 - a) * var[n - 1]
-			cast.RateMean += cast.rateUnit / 2
-			cast.RateVar += cast.rateUnit*cast.rateUnit - cast.RateVar/2
-			cast.rateUnit = -cast.RateMean
+		}(i)
+	}
+}
+
+func (ctx *BroadcastSet) tick(shard *broadcastSetShard) {
+	var dirty, expired []string
+	shard.RLock()
+	for id, cast := range shard.streams {
+		if atomic.SwapInt32(&cast.dirty, 0) != 0 {
+			dirty = append(dirty, id)
+		}
+		if t := atomic.LoadInt64(&cast.closing); t >= 0 {
+			// Losing this to a concurrent `Close` just delays the stream's expiry.
+			if atomic.CompareAndSwapInt64(&cast.closing, t, t+int64(time.Second)) && t+int64(time.Second) > int64(ctx.Timeout) {
+				expired = append(expired, id)
+			}
+		}
+		cast.sampleRate()
+	}
+	shard.RUnlock()
+
+	for _, id := range dirty {
+		if cast, ok := ctx.Readable(id); ok {
+			info := cast.TrackInfo()
+			ctx.OnStreamTrackInfo(id, &info)
 		}
-		ticker.Stop()
-
-		ctx.mutex.Lock()
-		delete(ctx.streams, id)
-		ctx.mutex.Unlock()
-		cast.Closed = true
-		cast.vlock.Lock()
-		for _, cb := range cast.viewers {
-			cb.write([]byte{})
+	}
+	for _, id := range expired {
+		shard.Lock()
+		cast, ok := shard.streams[id]
+		// The stream may have been resumed in the meantime. See `Resume`.
+		if ok {
+			if t := atomic.LoadInt64(&cast.closing); t > int64(ctx.Timeout) {
+				ok = atomic.CompareAndSwapInt64(&cast.closing, t, -2)
+			} else {
+				ok = false
+			}
 		}
-		cast.vlock.Unlock()
-		if ctx.OnStreamClose != nil {
-			ctx.OnStreamClose(id)
+		if ok {
+			delete(shard.streams, id)
+			shard.removeRendition(id, cast)
 		}
-	}()
-	return &cast, true
+		shard.Unlock()
+		if ok {
+			cast.vlock.Lock()
+			cast.Closed = true
+			cast.vlock.Unlock()
+			cast.vcond.Broadcast()
+			if ctx.OnStreamClose != nil {
+				ctx.OnStreamClose(id)
+			}
+		}
+	}
 }
 
-func (cast *Broadcast) Close() error {
-	cast.closing = 0
-	return nil
+func (cast *Broadcast) sampleRate() {
+	// exponentially weighted moving moments at a = 0.5
+	//     avg[n] = a * x + (1 - a) * avg[n - 1]
+	//     var[n] = a * (x - avg[n]) ** 2 / (1 - a) + (1 - a) * var[n - 1]
+	mean := math.Float64frombits(atomic.LoadUint64(&cast.rateMean))
+	vari := math.Float64frombits(atomic.LoadUint64(&cast.rateVar))
+	delta := float64(atomic.SwapUint64(&cast.rateBytes, 0)) - mean
+	atomic.StoreUint64(&cast.rateMean, math.Float64bits(mean+delta/2))
+	atomic.StoreUint64(&cast.rateVar, math.Float64bits(vari/2+delta*delta))
+}
+
+// The mean and variance of the stream's bitrate, in bytes per second.
+func (cast *Broadcast) Rate() (float64, float64) {
+	return math.Float64frombits(atomic.LoadUint64(&cast.rateMean)),
+		math.Float64frombits(atomic.LoadUint64(&cast.rateVar))
 }
 
-func (cast *Broadcast) Connect(ch chan<- []byte, skipHeaders bool) {
-	blocked := false
-	write := func(data []byte) bool {
-		// `Broadcast.Write` emits data in block-sized chunks.
-		// Thus the buffer size is measured in frames, not bytes.
-		blocked = len(ch) == cap(ch) || (blocked && len(ch)*2 >= cap(ch))
-		if !blocked {
-			ch <- data
+func (cast *Broadcast) TrackInfo() StreamTrackInfo {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return cast.info
+}
+
+// Give the stream a writer again, as long as it has none and has not expired yet.
+// Unlike `BroadcastSet.Writable`, this does not need the set's lock.
+func (cast *Broadcast) Resume() bool {
+	for {
+		// -1 means there is a writer; -2 means the stream has been removed from the set.
+		t := atomic.LoadInt64(&cast.closing)
+		if t < 0 {
+			return false
+		}
+		if atomic.CompareAndSwapInt64(&cast.closing, t, -1) {
+			return true
 		}
-		return !blocked
 	}
+}
+
+func (cast *Broadcast) Close() error {
+	atomic.StoreInt64(&cast.closing, 0)
+	return nil
+}
 
+// Start reading the stream from the join point. Unless `skipHeaders` is set, the first
+// call to `Read` on the returned viewer will also return the EBML header and track info.
+func (cast *Broadcast) Connect(skipHeaders bool) *viewer {
 	cast.vlock.Lock()
-	cast.viewers[ch] = &viewer{write: write}
+	cb := &viewer{cast: cast, cursor: cast.frames.JoinPoint(), skipHeaders: skipHeaders}
+	cast.viewers[cb] = struct{}{}
 	cast.vlock.Unlock()
+	return cb
 }
 
-func (cast *Broadcast) Disconnect(ch chan<- []byte) {
+func (cast *Broadcast) Disconnect(cb *viewer) {
 	cast.vlock.Lock()
-	delete(cast.viewers, ch)
+	delete(cast.viewers, cb)
 	cast.vlock.Unlock()
 }
 
+func (cast *Broadcast) ViewerCount() int {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return len(cast.viewers)
+}
+
 func (cast *Broadcast) Reset() {
 	cast.buffer = nil
 }
 
 func (cast *Broadcast) Write(data []byte) (int, error) {
-	cast.rateUnit += float64(len(data))
-	cast.buffer = append(cast.buffer, data...)
+	atomic.AddUint64(&metrics.ingestBytes, uint64(len(data)))
+	if cast.traceEvery != 0 {
+		cast.writeStart = time.Now().UnixNano()
+	}
+	n, err := cast.write(data)
+	if err != nil {
+		countParseError(err)
+	}
+	return n, err
+}
 
+func (cast *Broadcast) write(data []byte) (int, error) {
+	atomic.AddUint64(&cast.rateBytes, uint64(len(data)))
+	written := len(data)
+
+	for len(cast.buffer) != 0 && len(data) != 0 {
+		// Complete the tag split by the previous call, copying no more than it needs.
+		// Once that's done, the rest of the data can be parsed in place.
+		need := uint64(ebmlMaxHeaderLength)
+		if tag := ebmlParseTagIncomplete(cast.buffer); tag.Consumed != 0 {
+			need = uint64(tag.Consumed)
+			if !tag.IsContainer() && tag.Length <= ebmlMaxTagLength {
+				need += tag.Length
+			}
+		}
+		take := 0
+		if need > uint64(len(cast.buffer)) {
+			take = len(data)
+			if need-uint64(len(cast.buffer)) < uint64(take) {
+				take = int(need) - len(cast.buffer)
+			}
+		}
+		cast.extend(data[:take])
+		data = data[take:]
+
+		consumed, err := cast.parse(cast.buffer, true)
+		if err != nil {
+			return 0, err
+		}
+		if consumed == 0 && take == 0 {
+			return 0, errors.New("malformed EBML")
+		}
+		cast.buffer = cast.buffer[consumed:]
+	}
+
+	if len(cast.buffer) == 0 && len(data) != 0 {
+		consumed, err := cast.parse(data, false)
+		if err != nil {
+			return 0, err
+		}
+		cast.extend(data[consumed:])
+	}
+	return written, nil
+}
+
+// Move data to the end of the slab, right after the incomplete tag that is already there.
+func (cast *Broadcast) extend(data []byte) {
+	if len(data) > cap(cast.slab)-len(cast.slab) {
+		size := ebmlSlabSize
+		if len(cast.buffer)+len(data) > size {
+			size = len(cast.buffer) + len(data)
+		}
+		cast.slab = append(make([]byte, 0, size), cast.buffer...)
+	}
+	size := len(cast.buffer) + len(data)
+	cast.slab = append(cast.slab, data...)
+	cast.buffer = cast.slab[len(cast.slab)-size:]
+}
+
+// Copy a frame into the slab. Frames are referenced by the framebuffer and by viewers
+// until they are done with them, so a slab is never reused, only replaced when full.
+// (Must not be called while there's an incomplete tag at the end of the slab.)
+func (cast *Broadcast) retain(data []byte) []byte {
+	if len(data) > cap(cast.slab)-len(cast.slab) {
+		size := ebmlSlabSize
+		if len(data) > size {
+			size = len(data)
+		}
+		cast.slab = make([]byte, 0, size)
+	}
+	start := len(cast.slab)
+	cast.slab = append(cast.slab, data...)
+	return cast.slab[start:len(cast.slab):len(cast.slab)]
+}
+
+// Parse as many complete tags as possible, returning the number of bytes they occupy.
+// Tags that need to be kept are copied unless `inSlab` is set, in which case `data`
+// is the incomplete tag buffer and can be referenced directly.
+func (cast *Broadcast) parse(data []byte, inSlab bool) (int, error) {
+	consumed := 0
 	for {
-		buf := cast.buffer
+		buf := data[consumed:]
 		tag := ebmlParseTagIncomplete(buf)
 		if tag.Consumed == 0 {
-			return len(data), nil
+			return consumed, nil
 		}
 
-		if tag.ID == ebmlTagSegment || tag.ID == ebmlTagTracks || tag.ID == ebmlTagCluster {
+		if tag.IsContainer() {
 			// Parse the contents of these tags in the same loop.
 			buf = buf[:tag.Consumed]
 		} else {
@@ -369,12 +707,12 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 				return 0, errors.New("exact length required for all tags but Segments and Clusters")
 			}
 			total := tag.Length + uint64(tag.Consumed)
-			if total > 1024*1024 {
+			if total > ebmlMaxTagLength {
 				return 0, errors.New("data block too big")
 			}
 
 			if total > uint64(len(buf)) {
-				return len(data), nil
+				return consumed, nil
 			}
 
 			buf = buf[:total]
@@ -404,6 +742,8 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 
 		case ebmlTagSegment:
 			cast.StreamTrackInfo = StreamTrackInfo{}
+			cast.videoTracks = 0
+			cast.codecs = ""
 			// Always reset length to indeterminate.
 			cast.tracks = append([]byte{}, buf[0], buf[1], buf[2], buf[3], 0xFF)
 			// Will recalculate this when the first block arrives.
@@ -415,6 +755,10 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 			// in WebM; we'll check just in case. Obviously, our timecode rewriting
 			// logic won't work with non-millisecond resolutions.
 			scale := uint64(0)
+			// The Duration is overwritten below, so this must be a copy.
+			start := len(cast.tracks)
+			cast.tracks = append(cast.tracks, buf...)
+			buf = cast.tracks[start:]
 
 			for buf2 := tag.Contents(buf); len(buf2) != 0; {
 				tag2 := ebmlParseTag(buf2)
@@ -440,12 +784,13 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 			}
 
 			if scale != 1000000 {
+				cast.tracks = cast.tracks[:start]
 				return 0, errors.New("invalid timecode scale")
 			}
 
-			cast.tracks = append(cast.tracks, buf...)
-
 		case ebmlTagTrackEntry:
+			number, video := uint64(0), false
+
 			for buf2 := tag.Contents(buf); len(buf2) != 0; {
 				tag2 := ebmlParseTag(buf2)
 
@@ -455,15 +800,23 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 
 				case ebmlTagTrackNumber:
 					// `viewer.seenKeyframes` is a 32-bit vector.
-					if fixedUint(tag2.Contents(buf2)) >= 32 {
+					if number = fixedUint(tag2.Contents(buf2)); number >= 32 {
 						return 0, errors.New("too many tracks")
 					}
 
+				case ebmlTagCodecID:
+					if codec := mseCodecName(string(tag2.Contents(buf2))); cast.codecs == "" {
+						cast.codecs = codec
+					} else {
+						cast.codecs += "," + codec
+					}
+
 				case ebmlTagAudio:
 					cast.HasAudio = true
 
 				case ebmlTagVideo:
 					cast.HasVideo = true
+					video = true
 					for buf3 := tag2.Contents(buf2); len(buf3) != 0; {
 						tag3 := ebmlParseTag(buf3)
 
@@ -485,8 +838,15 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 				buf2 = tag2.Skip(buf2)
 			}
 
+			if video {
+				cast.videoTracks |= 1 << number
+			}
 			cast.tracks = append(cast.tracks, buf...)
-			cast.dirty = true
+			cast.vlock.Lock()
+			cast.info = cast.StreamTrackInfo
+			cast.mimeType = `video/webm; codecs="` + cast.codecs + `"`
+			cast.vlock.Unlock()
+			atomic.StoreInt32(&cast.dirty, 1)
 
 		case ebmlTagTracks:
 			cast.tracks = append(cast.tracks, buf...)
@@ -545,33 +905,39 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 			}
 
 			ctc := cast.recvClusterTimecode
-			cluster := []byte{
-				// indeterminate length cluster
-				ebmlTagCluster >> 24 & 0xFF, ebmlTagCluster >> 16 & 0xFF, ebmlTagCluster >> 8 & 0xFF, ebmlTagCluster & 0xFF, 0xFF,
-				// first child: 8-byte timecode
-				ebmlTagTimecode, 0x88,
-				byte(ctc >> 56), byte(ctc >> 48), byte(ctc >> 40), byte(ctc >> 32),
-				byte(ctc >> 24), byte(ctc >> 16), byte(ctc >> 8), byte(ctc),
+			if ctc != cast.sentClusterTimecode {
+				// Viewers and the framebuffer all share this header, so it is only
+				// rebuilt when the timecode changes and never modified afterwards.
+				cast.cluster = []byte{
+					// indeterminate length cluster
+					ebmlTagCluster >> 24 & 0xFF, ebmlTagCluster >> 16 & 0xFF, ebmlTagCluster >> 8 & 0xFF, ebmlTagCluster & 0xFF, 0xFF,
+					// first child: 8-byte timecode
+					ebmlTagTimecode, 0x88,
+					byte(ctc >> 56), byte(ctc >> 48), byte(ctc >> 40), byte(ctc >> 32),
+					byte(ctc >> 24), byte(ctc >> 16), byte(ctc >> 8), byte(ctc),
+				}
 			}
-			packed := frame{buf, track, key}
-
-			forceCluster := ctc != cast.sentClusterTimecode
-			cast.vlock.Lock()
-			for _, cb := range cast.viewers {
-				if !cb.skipHeaders {
-					if !cb.write(cast.header) || !cb.write(cast.tracks) {
-						continue // FIXME: if second write failed, the stream will not be a valid mkv
-					}
-					cb.skipHeaders = true
-					cast.frames.Read(cb.WriteFrame)
+			if !inSlab {
+				buf = cast.retain(buf)
+			}
+			traced := int64(0)
+			if cast.traceEvery != 0 {
+				if cast.traceCount++; cast.traceCount%cast.traceEvery == 0 {
+					traced = time.Now().UnixNano()
+					metrics.traceIngest.Observe(time.Duration(traced - cast.writeStart))
 				}
-				cb.WriteFrame(cluster, forceCluster, packed)
 			}
+			// Viewers copy what they need while holding a read lock, then write it out
+			// on their own goroutines, so this does not depend on how many there are.
+			cast.vlock.Lock()
+			// Viewers can only start decoding video from a keyframe. Audio tracks
+			// are not as picky (all Opus and Vorbis frames are keyframes.)
+			joinable := key && (cast.videoTracks == 0 || cast.videoTracks&(1<<track) != 0)
+			cast.frames.Push(frame{buf, cast.cluster, track, ctc + timecode, traced, key}, joinable)
+			cast.joinHeader = cast.header
+			cast.joinTracks = cast.tracks
 			cast.vlock.Unlock()
-			if forceCluster {
-				cast.frames.PushCluster(cluster)
-			}
-			cast.frames.PushFrame(packed)
+			cast.vcond.Broadcast()
 			cast.sentClusterTimecode = ctc
 			cast.firstBlockInSegment = false
 
@@ -579,6 +945,6 @@ func (cast *Broadcast) Write(data []byte) (int, error) {
 			return 0, errors.New("unknown EBML tag")
 		}
 
-		cast.buffer = cast.buffer[len(buf):]
+		consumed += len(buf)
 	}
 }
@@ -0,0 +1,327 @@
+package main
+
+import (
+	"math/rand"
+	"strconv"
+	"testing"
+	"time"
+)
+
+// Synthetic WebM with a video track at 30 fps and an Opus track at 50 fps. Every video
+// keyframe starts a new Cluster. Nothing is decoded, so only the sizes of the frames matter.
+type testStream struct {
+	name   string
+	codec  string // of the video track
+	gop    int    // video frames per keyframe
+	frames int    // video frames in total
+}
+
+var testStreams = []testStream{
+	{"vp8-opus/gop=30", "V_VP8", 30, 300},
+	{"vp8-opus/gop=300", "V_VP8", 300, 600},
+	{"vp9-opus/gop=30", "V_VP9", 30, 300},
+	{"vp9-opus/gop=300", "V_VP9", 300, 600},
+}
+
+const (
+	testKeyframeSize = 40000
+	testFrameSize    = 4000
+	testAudioSize    = 160 // 64 kbit/s
+)
+
+func testID(out []byte, id uint32) []byte {
+	for shift := uint(24); shift != 0; shift -= 8 {
+		if id>>shift != 0 {
+			out = append(out, byte(id>>shift))
+		}
+	}
+	return append(out, byte(id))
+}
+
+func testTag(id uint32, data ...[]byte) []byte {
+	size := 0
+	for _, d := range data {
+		size += len(d)
+	}
+	out := testID(nil, id)
+	out = append(out, 0x01, 0, 0, byte(size>>32), byte(size>>24), byte(size>>16), byte(size>>8), byte(size))
+	for _, d := range data {
+		out = append(out, d...)
+	}
+	return out
+}
+
+func testUint(id uint32, x uint64) []byte {
+	return testTag(id, []byte{byte(x >> 56), byte(x >> 48), byte(x >> 40), byte(x >> 32), byte(x >> 24), byte(x >> 16), byte(x >> 8), byte(x)})
+}
+
+func testBlock(track byte, timecode uint64, key bool, size int) []byte {
+	block := make([]byte, 4+size)
+	block[0], block[1], block[2] = 0x80|track, byte(timecode>>8), byte(timecode)
+	if key {
+		block[3] = 0x80
+	}
+	return testTag(ebmlTagSimpleBlock, block)
+}
+
+func (s testStream) header() []byte {
+	out := testTag(ebmlTagEBML, testTag(0x4282, []byte("webm")))
+	out = append(testID(out, ebmlTagSegment), 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+	out = append(out, testTag(ebmlTagInfo, testUint(ebmlTagTimecodeScale, 1000000))...)
+	return append(out, testTag(ebmlTagTracks,
+		testTag(ebmlTagTrackEntry, testUint(ebmlTagTrackNumber, 1), testUint(ebmlTagTrackType, 1),
+			testTag(ebmlTagCodecID, []byte(s.codec)),
+			testTag(ebmlTagVideo, testUint(ebmlTagPixelWidth, 1280), testUint(ebmlTagPixelHeight, 720))),
+		testTag(ebmlTagTrackEntry, testUint(ebmlTagTrackNumber, 2), testUint(ebmlTagTrackType, 2),
+			testTag(ebmlTagCodecID, []byte("A_OPUS")), testTag(ebmlTagAudio)),
+	)...)
+}
+
+func (s testStream) webm() []byte {
+	out, cluster := s.header(), uint64(0)
+	for n, audio := 0, 0; n < s.frames; n++ {
+		timecode := uint64(n * 1000 / 30)
+		if n%s.gop == 0 {
+			cluster = timecode
+			out = append(testID(out, ebmlTagCluster), 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+			out = append(out, testUint(ebmlTagTimecode, cluster)...)
+			out = append(out, testBlock(1, 0, true, testKeyframeSize)...)
+		} else {
+			out = append(out, testBlock(1, timecode-cluster, false, testFrameSize)...)
+		}
+		for ; uint64(audio*20) < timecode+1000/30; audio++ {
+			if uint64(audio*20) >= cluster {
+				out = append(out, testBlock(2, uint64(audio*20)-cluster, true, testAudioSize)...)
+			}
+		}
+	}
+	return out
+}
+
+// Cut the data at random points, the way requests and websocket messages may be.
+func testSplit(data []byte, mean int) [][]byte {
+	r := rand.New(rand.NewSource(1))
+	chunks := [][]byte{}
+	for len(data) != 0 {
+		n := 1 + r.Intn(2*mean)
+		if n > len(data) {
+			n = len(data)
+		}
+		chunks = append(chunks, data[:n])
+		data = data[n:]
+	}
+	return chunks
+}
+
+func testBroadcastSet() *BroadcastSet {
+	return &BroadcastSet{
+		Timeout:           time.Minute,
+		BufferSize:        16 * 1024 * 1024,
+		OnStreamClose:     func(string) {},
+		OnStreamTrackInfo: func(string, *StreamTrackInfo) {},
+	}
+}
+
+func reportPerByte(b *testing.B, n int) {
+	b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N)/float64(n), "ns/byte")
+}
+
+func BenchmarkParseTag(b *testing.B) {
+	for _, s := range testStreams {
+		data := s.webm()
+		b.Run(s.name, func(b *testing.B) {
+			b.ReportAllocs()
+			for i := 0; i < b.N; i++ {
+				for buf := data; len(buf) != 0; {
+					tag := ebmlParseTagIncomplete(buf)
+					if tag.Consumed == 0 {
+						b.Fatal("malformed EBML")
+					}
+					if tag.IsContainer() {
+						buf = buf[tag.Consumed:]
+					} else {
+						buf = tag.Skip(buf)
+					}
+				}
+			}
+			reportPerByte(b, len(data))
+		})
+	}
+}
+
+// One op is the whole stream, either in one piece or in chunks of 4 KiB on average.
+func BenchmarkWrite(b *testing.B) {
+	for _, s := range testStreams {
+		data := s.webm()
+		for _, split := range []string{"whole", "split"} {
+			chunks := [][]byte{data}
+			if split == "split" {
+				chunks = testSplit(data, 4096)
+			}
+			b.Run(s.name+"/"+split, func(b *testing.B) {
+				cast, _ := testBroadcastSet().Writable("bench")
+				b.ReportAllocs()
+				for i := 0; i < b.N; i++ {
+					for _, chunk := range chunks {
+						if _, err := cast.Write(chunk); err != nil {
+							b.Fatal(err)
+						}
+					}
+				}
+				reportPerByte(b, len(data))
+			})
+		}
+	}
+}
+
+// One op is a single block within the current Cluster. The Cluster header is only
+// built when the timecode changes, and blocks are copied into shared slabs, so the
+// only allocations are new slabs, amortized over all the blocks that fit in one.
+// See `TestWriteBlockAllocs` for the blocks in between.
+func BenchmarkWriteBlock(b *testing.B) {
+	set := testBroadcastSet()
+	set.BufferSize = 1024 * 1024
+	cast, _ := set.Writable("bench")
+	s := testStreams[0]
+	header := append(s.header(), testID(nil, ebmlTagCluster)...)
+	header = append(header, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+	header = append(header, testUint(ebmlTagTimecode, 0)...)
+	header = append(header, testBlock(1, 0, true, testKeyframeSize)...)
+	if _, err := cast.Write(header); err != nil {
+		b.Fatal(err)
+	}
+	block := testBlock(1, 33, false, testFrameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := cast.Write(block); err != nil {
+			b.Fatal(err)
+		}
+	}
+	reportPerByte(b, len(block))
+}
+
+func TestWriteBlockAllocs(t *testing.T) {
+	cast, _ := testBroadcastSet().Writable("test")
+	if _, err := cast.Write(append(testStreams[0].cluster(0), testBlock(1, 0, true, testKeyframeSize)...)); err != nil {
+		t.Fatal(err)
+	}
+	block := testBlock(1, 33, false, testAudioSize)
+	// `AllocsPerRun` also does one run to warm up.
+	runs := (cap(cast.slab)-len(cast.slab))/len(block) - 1
+	if runs < 100 {
+		t.Fatalf("only %d blocks fit in the rest of the slab", runs)
+	}
+	allocs := testing.AllocsPerRun(runs, func() {
+		if _, err := cast.Write(block); err != nil {
+			t.Fatal(err)
+		}
+	})
+	if allocs != 0 {
+		t.Fatalf("%v allocations per block", allocs)
+	}
+}
+
+// One op is a frame that is pushed once and then read by every viewer.
+func BenchmarkFanout(b *testing.B) {
+	s := testStreams[0]
+	data := s.webm()
+	block := testBlock(1, 33, false, testFrameSize)
+	for _, n := range []int{1, 100, 10000} {
+		b.Run("viewers="+strconv.Itoa(n), func(b *testing.B) {
+			cast, _ := testBroadcastSet().Writable("bench")
+			if _, err := cast.Write(data); err != nil {
+				b.Fatal(err)
+			}
+			viewers := make([]*viewer, n)
+			out := make([][][]byte, n)
+			for i := range viewers {
+				viewers[i] = cast.Connect(false)
+				out[i], _ = viewers[i].Read(nil)
+			}
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if _, err := cast.Write(block); err != nil {
+					b.Fatal(err)
+				}
+				for j, cb := range viewers {
+					out[j], _ = cb.Read(out[j][:0])
+				}
+			}
+			b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N)/float64(n), "ns/viewer")
+		})
+	}
+}
+
+// One op is a new viewer receiving the headers and everything since the last keyframe.
+func BenchmarkConnect(b *testing.B) {
+	for _, s := range testStreams {
+		data := s.webm()
+		b.Run(s.name, func(b *testing.B) {
+			cast, _ := testBroadcastSet().Writable("bench")
+			if _, err := cast.Write(data); err != nil {
+				b.Fatal(err)
+			}
+			var out [][]byte
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				cb := cast.Connect(false)
+				out, _ = cb.Read(out[:0])
+				cast.Disconnect(cb)
+			}
+		})
+	}
+}
+
+// Viewers look up the stream on every connect, either all the same one (a popular
+// stream going live) or spread out. Run with e.g. `-cpu 1,2,4,8` to see how this scales.
+func BenchmarkReadable(b *testing.B) {
+	for _, n := range []int{1, 1000} {
+		b.Run("streams="+strconv.Itoa(n), func(b *testing.B) {
+			set := testBroadcastSet()
+			ids := make([]string, n)
+			for i := range ids {
+				ids[i] = "bench" + strconv.Itoa(i)
+				set.Writable(ids[i])
+			}
+			b.ReportAllocs()
+			b.ResetTimer()
+			b.RunParallel(func(pb *testing.PB) {
+				for i := rand.Int(); pb.Next(); i++ {
+					if _, ok := set.Readable(ids[i%len(ids)]); !ok {
+						b.Error("stream not found")
+						return
+					}
+				}
+			})
+		})
+	}
+}
+
+// The beginning of a stream that has just gone live, up to the start of its first Cluster.
+func (s testStream) cluster(timecode uint64) []byte {
+	out := append(s.header(), testID(nil, ebmlTagCluster)...)
+	out = append(out, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+	return append(out, testUint(ebmlTagTimecode, timecode)...)
+}
+
+// Audio comes first, and is not something a video player can start from.
+func TestSnapshotNoKeyframe(t *testing.T) {
+	cast, _ := testBroadcastSet().Writable("test")
+	data := append(testStreams[0].cluster(0), testBlock(2, 0, true, testAudioSize)...)
+	data = append(data, testBlock(1, 0, false, testFrameSize)...)
+	if _, err := cast.Write(data); err != nil {
+		t.Fatal(err)
+	}
+	if snapshot, _ := cast.Snapshot(); snapshot != nil {
+		t.Fatal("got a snapshot before the first keyframe")
+	}
+	if _, err := cast.Write(testBlock(1, 33, true, testKeyframeSize)); err != nil {
+		t.Fatal(err)
+	}
+	if snapshot, _ := cast.Snapshot(); len(snapshot) < testKeyframeSize {
+		t.Fatalf("the snapshot is %d bytes, which is less than the keyframe", len(snapshot))
+	}
+}
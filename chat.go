@@ -7,12 +7,18 @@ import (
 	"golang.org/x/net/websocket"
 	"net/rpc"
 	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
 type Chat struct {
 	events  chan interface{}
 	Users   map[*chatter]struct{}
 	History ChatMessageQueue
+	// the number of people watching the stream, in addition to those in the chat.
+	// may be nil; called from the chat's goroutine.
+	watchers func() int
 }
 
 type ChatMessage struct {
@@ -22,8 +28,11 @@ type ChatMessage struct {
 }
 
 type ChatMessageQueue struct {
+	lock  sync.Mutex
 	data  []ChatMessage
 	start int
+	// a `Chat.History` notification with all of the above, or nil if not encoded yet.
+	frame []byte
 }
 
 type chatter struct {
@@ -31,41 +40,85 @@ type chatter struct {
 	login  string
 	socket *websocket.Conn
 	chat   *Chat
+	// encoded notifications waiting to be sent by `writeLoop`. closed by the chat
+	// once this user has disconnected.
+	queue chan []byte
 }
 
+// how many notifications a user may fall behind by before getting disconnected.
+const chatterQueueSize = 256
+
+// the viewer count is sent at most this often, and only if it has changed.
+const chatViewerCountInterval = 2 * time.Second
+
 func (q *ChatMessageQueue) Push(x ChatMessage) {
+	q.lock.Lock()
 	if len(q.data) == cap(q.data) {
 		q.data[q.start] = x
 		q.start = (q.start + 1) % len(q.data)
 	} else {
 		q.data = append(q.data, x)
 	}
+	q.frame = nil
+	q.lock.Unlock()
 }
 
-func (q *ChatMessageQueue) Iterate(f func(x ChatMessage) error) error {
-	// this should be safe to use without a mutex. at worst, pushing more than
-	// `cap(q.data)` messages while iterating may result in skipping over some of them.
-	for i, s, n := 0, q.start, len(q.data); i < n; i++ {
-		if err := f(q.data[(i+s)%n]); err != nil {
-			return err
+// a single notification containing all messages, encoded once per change.
+// nil if there are no messages.
+func (q *ChatMessageQueue) Frame() []byte {
+	q.lock.Lock()
+	defer q.lock.Unlock()
+	if q.frame == nil && len(q.data) != 0 {
+		msgs := make([][]string, 0, len(q.data))
+		for i, s, n := 0, q.start, len(q.data); i < n; i++ {
+			x := &q.data[(i+s)%n]
+			msgs = append(msgs, []string{x.name, x.text, x.login})
 		}
+		q.frame, _ = RPCEncodeEvent("Chat.History", msgs)
 	}
-	return nil
+	return q.frame
 }
 
-func NewChat(qsize int) *Chat {
+func NewChat(qsize int, watchers func() int) *Chat {
 	ctx := &Chat{
-		events:  make(chan interface{}),
-		Users:   make(map[*chatter]struct{}),
-		History: ChatMessageQueue{make([]ChatMessage, 0, qsize), 0},
+		events:   make(chan interface{}),
+		Users:    make(map[*chatter]struct{}),
+		History:  ChatMessageQueue{data: make([]ChatMessage, 0, qsize)},
+		watchers: watchers,
 	}
 	go ctx.handle()
 	return ctx
 }
 
+func (c *Chat) viewerCount() int {
+	n := len(c.Users)
+	if c.watchers != nil {
+		// most users in the chat are also watching, but some might have the video disabled.
+		if w := c.watchers(); w > n {
+			n = w
+		}
+	}
+	return n
+}
+
 func (c *Chat) handle() {
 	closed := false
-	for genericEvent := range c.events {
+	count := -1
+	ticker := time.NewTicker(chatViewerCountInterval)
+	defer ticker.Stop()
+	for {
+		var genericEvent interface{}
+		select {
+		case genericEvent = <-c.events:
+			atomic.AddUint64(&metrics.chatEvents, 1)
+		case <-ticker.C:
+			if n := c.viewerCount(); n != count {
+				count = n
+				c.pushAll("Stream.ViewerCount", count)
+			}
+			continue
+		}
+
 		switch event := genericEvent.(type) {
 		case nil:
 			closed = true
@@ -79,27 +132,38 @@ func (c *Chat) handle() {
 		case *chatter:
 			if _, exists := c.Users[event]; exists {
 				delete(c.Users, event)
+				close(event.queue)
 				if closed && len(c.Users) == 0 {
 					return // if these events were left unhandled, senders would block forever
 				}
 			} else {
 				c.Users[event] = struct{}{}
-			}
-			for u := range c.Users {
-				u.pushViewerCount()
+				if count != -1 {
+					event.push("Stream.ViewerCount", count)
+				}
 			}
 
 		case ChatMessage:
 			c.History.Push(event)
-			for u := range c.Users {
-				u.pushMessage(event)
-			}
+			c.pushAll("Chat.Message", event.name, event.text, event.login)
 		}
 	}
 }
 
+// encode a notification once, then queue the same frame for every user.
+func (c *Chat) pushAll(name string, args ...interface{}) {
+	frame, err := RPCEncodeEvent(name, args...)
+	if err != nil {
+		return
+	}
+	for u := range c.Users {
+		u.send(frame)
+	}
+}
+
 func (c *Chat) Connect(ws *websocket.Conn, auth *UserData) *chatter {
-	chatter := &chatter{socket: ws, chat: c}
+	chatter := &chatter{socket: ws, chat: c, queue: make(chan []byte, chatterQueueSize)}
+	go chatter.writeLoop()
 	if auth != nil {
 		chatter.name = auth.Name
 		chatter.login = auth.Login
@@ -117,13 +181,20 @@ func (c *Chat) Close() {
 	c.events <- nil
 }
 
-func (chat *Chat) RunRPC(ws *websocket.Conn, user *UserData) {
+// Serve JSON-RPC on a websocket until it closes. `stream`, if not nil, provides
+// the methods of `Stream`.
+func (chat *Chat) RunRPC(ws *websocket.Conn, user *UserData, stream interface{}) {
 	chatter := chat.Connect(ws, user)
 	defer chat.Disconnect(chatter)
-	RPCPushEvent(ws, "RPC.Loaded", true)
-	chat.History.Iterate(chatter.pushMessage)
+	chatter.push("RPC.Loaded", true)
+	if frame := chat.History.Frame(); frame != nil {
+		chatter.send(frame)
+	}
 	server := rpc.NewServer()
 	server.RegisterName("Chat", chatter)
+	if stream != nil {
+		server.RegisterName("Stream", stream)
+	}
 	server.ServeCodec(jsonrpc2.NewServerCodec(ws, server))
 }
 
@@ -143,12 +214,21 @@ func (x *RPCSingleStringArg) UnmarshalJSON(buf []byte) error {
 	return nil
 }
 
-func RPCPushEvent(ws *websocket.Conn, name string, args ...interface{}) error {
-	return websocket.JSON.Send(ws, map[string]interface{}{
+func RPCEncodeEvent(name string, args ...interface{}) ([]byte, error) {
+	return json.Marshal(map[string]interface{}{
 		"jsonrpc": "2.0", "method": name, "params": args,
 	})
 }
 
+func RPCPushEvent(ws *websocket.Conn, name string, args ...interface{}) error {
+	frame, err := RPCEncodeEvent(name, args...)
+	if err != nil {
+		return err
+	}
+	_, err = ws.Write(frame)
+	return err
+}
+
 func (ctx *chatter) SetName(args *RPCSingleStringArg, _ *interface{}) error {
 	name := strings.TrimSpace(args.First)
 	if err := ValidateUsername(name); err != nil {
@@ -171,14 +251,33 @@ func (ctx *chatter) SendMessage(args *RPCSingleStringArg, _ *interface{}) error
 	return nil
 }
 
-func (ctx *chatter) pushName() error {
-	return RPCPushEvent(ctx.socket, "Chat.AcquiredName", ctx.name, ctx.login)
+// queue an encoded notification without waiting for the socket. a user that
+// does not read them fast enough is disconnected rather than allowed to hold up the chat.
+func (ctx *chatter) send(frame []byte) {
+	select {
+	case ctx.queue <- frame:
+	default:
+		atomic.AddUint64(&metrics.chatDropped, 1)
+		ctx.socket.Close()
+	}
+}
+
+func (ctx *chatter) writeLoop() {
+	for frame := range ctx.queue {
+		if _, err := ctx.socket.Write(frame); err != nil {
+			ctx.socket.Close() // the rest of the queue will fail immediately
+		}
+	}
 }
 
-func (ctx *chatter) pushMessage(msg ChatMessage) error {
-	return RPCPushEvent(ctx.socket, "Chat.Message", msg.name, msg.text, msg.login)
+func (ctx *chatter) push(name string, args ...interface{}) error {
+	frame, err := RPCEncodeEvent(name, args...)
+	if err == nil {
+		ctx.send(frame)
+	}
+	return err
 }
 
-func (ctx *chatter) pushViewerCount() error {
-	return RPCPushEvent(ctx.socket, "Stream.ViewerCount", len(ctx.chat.Users))
+func (ctx *chatter) pushName() error {
+	return ctx.push("Chat.AcquiredName", ctx.name, ctx.login)
 }
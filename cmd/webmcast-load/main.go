@@ -0,0 +1,326 @@
+// A load generator that talks to a webmcast node the way real clients do:
+// broadcasters POST synthetic WebM, viewers GET it, and chatters send messages
+// to each other over the JSON-RPC websocket.
+//
+//     webmcast -ephemeral &
+//     webmcast-load -broadcasters 4 -viewers 200 -chatters 50 -split frames
+//
+// Stream names are `<prefix><n>`; broadcasters all use the same token, which is
+// only accepted as is by an `-ephemeral` server. Every few seconds, it prints
+// delivered bitrate per viewer, frames lost to keyframe resyncs, time to first
+// frame, frame latency (from generation to arrival) and chat latency.
+//
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"golang.org/x/net/websocket"
+	"io"
+	"io/ioutil"
+	"log"
+	"math/rand"
+	"net/http"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+var (
+	server       = flag.String("server", "http://localhost:8000", "The node to connect to.")
+	prefix       = flag.String("prefix", "load", "Stream names are this followed by a number.")
+	token        = flag.String("token", "load", "The token to broadcast with.")
+	broadcasters = flag.Int("broadcasters", 1, "How many streams to publish.")
+	viewers      = flag.Int("viewers", 10, "How many HTTP viewers to spread among the streams.")
+	chatters     = flag.Int("chatters", 0, "How many websocket clients to spread among the streams.")
+	split        = flag.String("split", "stream", "How to send the WebM: `stream` (one request, random writes), chunks (a request per random chunk), or frames (a request per frame.)")
+	chunkSize    = flag.Int("chunk", 16384, "The average size of a write or request with -split stream or chunks.")
+	bitrate      = flag.Int("bitrate", 2000000, "Bits per second per stream.")
+	fps          = flag.Int("fps", 30, "Frames per second.")
+	gop          = flag.Int("gop", 60, "Frames between keyframes.")
+	chatEvery    = flag.Duration("chat-interval", time.Second, "How often each chatter sends a message.")
+	ramp         = flag.Duration("ramp", 10*time.Second, "How long to spread out the viewers' and chatters' connections over.")
+	duration     = flag.Duration("duration", time.Minute, "How long to run for.")
+	report       = flag.Duration("report", 5*time.Second, "How often to print statistics.")
+)
+
+// Everything measured since the last report.
+type stats struct {
+	sync.Mutex
+	viewerBytes   map[int]int64
+	resyncs       int
+	dropped       uint64
+	firstFrame    []time.Duration
+	frameLatency  []time.Duration
+	chatLatency   []time.Duration
+	chatSent      int
+	errors        map[string]int
+	viewersOnline int
+}
+
+var measured = stats{viewerBytes: make(map[int]int64), errors: make(map[string]int)}
+
+func (s *stats) fail(what string, err error) {
+	s.Lock()
+	s.errors[what+": "+err.Error()]++
+	s.Unlock()
+}
+
+func streamURL(n int) string {
+	return *server + "/stream/" + *prefix + strconv.Itoa(n)
+}
+
+func broadcast(n int) {
+	g := &generator{fps: *fps, gop: *gop, size: *bitrate / 8 / *fps}
+	url := streamURL(n) + "?" + *token
+	post := func(body io.Reader) {
+		rsp, err := http.Post(url, "video/webm", body)
+		if err != nil {
+			measured.fail("broadcaster", err)
+			return
+		}
+		io.Copy(ioutil.Discard, rsp.Body)
+		rsp.Body.Close()
+		if rsp.StatusCode != http.StatusNoContent {
+			measured.fail("broadcaster", fmt.Errorf("%s", rsp.Status))
+		}
+	}
+	randomSize := func() int {
+		return 1 + rand.Intn(2**chunkSize)
+	}
+
+	switch *split {
+	case "frames":
+		post(bytes.NewReader(g.Header()))
+		for {
+			post(bytes.NewReader(g.Next()))
+		}
+	case "chunks":
+		buf := g.Header()
+		for next := randomSize(); ; next = randomSize() {
+			for len(buf) < next {
+				buf = append(buf, g.Next()...)
+			}
+			post(bytes.NewReader(buf[:next]))
+			buf = append(buf[:0], buf[next:]...)
+		}
+	default:
+		for {
+			r, w := io.Pipe()
+			go func() {
+				buf := g.Header()
+				for {
+					for next := randomSize(); len(buf) >= next; next = randomSize() {
+						if _, err := w.Write(buf[:next]); err != nil {
+							return
+						}
+						buf = buf[next:]
+					}
+					buf = append(buf, g.Next()...)
+				}
+			}()
+			post(r) // only returns on error
+			r.Close()
+			time.Sleep(time.Second)
+		}
+	}
+}
+
+func watch(id int, n int) {
+	start := time.Now()
+	rsp, err := http.Get(streamURL(n))
+	if err != nil {
+		measured.fail("viewer", err)
+		return
+	}
+	defer rsp.Body.Close()
+	if rsp.StatusCode != http.StatusOK {
+		measured.fail("viewer", fmt.Errorf("%s", rsp.Status))
+		return
+	}
+	measured.Lock()
+	measured.viewersOnline++
+	measured.Unlock()
+	defer func() {
+		measured.Lock()
+		measured.viewersOnline--
+		measured.Unlock()
+	}()
+
+	expect, received := uint64(0), 0
+	counter := &countingReader{Reader: rsp.Body, id: id}
+	err = readBlocks(bufio.NewReader(counter), func(block []byte) {
+		if len(block) < 4+framePrefixLength {
+			return
+		}
+		seq := binary.BigEndian.Uint64(block[4:])
+		sent := time.Unix(0, int64(binary.BigEndian.Uint64(block[12:])))
+		measured.Lock()
+		if received == 0 {
+			measured.firstFrame = append(measured.firstFrame, time.Since(start))
+		} else if seq > expect {
+			// the server skipped to the next keyframe.
+			measured.resyncs++
+			measured.dropped += seq - expect
+		}
+		if received >= *gop {
+			// the first GOP is sent all at once when connecting and would skew this.
+			measured.frameLatency = append(measured.frameLatency, time.Since(sent))
+		}
+		measured.Unlock()
+		expect, received = seq+1, received+1
+	})
+	if err != nil && err != io.EOF {
+		measured.fail("viewer", err)
+	}
+}
+
+type countingReader struct {
+	io.Reader
+	id int
+}
+
+func (r *countingReader) Read(buf []byte) (int, error) {
+	n, err := r.Reader.Read(buf)
+	measured.Lock()
+	measured.viewerBytes[r.id] += int64(n)
+	measured.Unlock()
+	return n, err
+}
+
+type rpcMessage struct {
+	Method string            `json:"method"`
+	Params []json.RawMessage `json:"params"`
+	ID     *int              `json:"id"`
+	Error  *json.RawMessage  `json:"error"`
+}
+
+func chat(id int, n int) {
+	url := "ws" + strings.TrimPrefix(streamURL(n), "http")
+	ws, err := websocket.Dial(url, "", *server)
+	if err != nil {
+		measured.fail("chatter", err)
+		return
+	}
+	defer ws.Close()
+	call := func(seq int, method string, arg string) error {
+		return websocket.JSON.Send(ws, map[string]interface{}{
+			"jsonrpc": "2.0", "id": seq, "method": method, "params": []string{arg},
+		})
+	}
+	if err := call(0, "Chat.SetName", fmt.Sprintf("%s-%d-%d", *prefix, id, rand.Intn(1000000))); err != nil {
+		measured.fail("chatter", err)
+		return
+	}
+
+	go func() {
+		for seq := 1; ; seq++ {
+			time.Sleep(*chatEvery)
+			if call(seq, "Chat.SendMessage", strconv.FormatInt(time.Now().UnixNano(), 10)) != nil {
+				return
+			}
+			measured.Lock()
+			measured.chatSent++
+			measured.Unlock()
+		}
+	}()
+	for {
+		var msg rpcMessage
+		if err := websocket.JSON.Receive(ws, &msg); err != nil {
+			measured.fail("chatter", err)
+			return
+		}
+		if msg.Error != nil {
+			measured.fail("chatter", fmt.Errorf("%s", *msg.Error))
+		}
+		if msg.Method != "Chat.Message" || len(msg.Params) < 2 {
+			continue
+		}
+		var text string
+		if json.Unmarshal(msg.Params[1], &text) != nil {
+			continue
+		}
+		if sent, err := strconv.ParseInt(text, 10, 64); err == nil {
+			measured.Lock()
+			measured.chatLatency = append(measured.chatLatency, time.Since(time.Unix(0, sent)))
+			measured.Unlock()
+		}
+	}
+}
+
+func percentiles(xs []time.Duration) string {
+	if len(xs) == 0 {
+		return "-"
+	}
+	sort.Slice(xs, func(i, j int) bool { return xs[i] < xs[j] })
+	at := func(p float64) time.Duration { return xs[int(p*float64(len(xs)-1))] }
+	return fmt.Sprintf("p50 %v p90 %v p99 %v max %v (n=%d)", at(.5), at(.9), at(.99), xs[len(xs)-1], len(xs))
+}
+
+func printReport(elapsed time.Duration) {
+	measured.Lock()
+	rates := []float64{}
+	for id, n := range measured.viewerBytes {
+		rates = append(rates, float64(n)*8/elapsed.Seconds()/1000)
+		delete(measured.viewerBytes, id)
+	}
+	sort.Float64s(rates)
+	fmt.Printf("--- %d viewers online\n", measured.viewersOnline)
+	if len(rates) != 0 {
+		fmt.Printf("bitrate (kbit/s):    min %.0f median %.0f max %.0f\n", rates[0], rates[len(rates)/2], rates[len(rates)-1])
+	}
+	fmt.Printf("resyncs:             %d (%d frames dropped)\n", measured.resyncs, measured.dropped)
+	fmt.Printf("time to first frame: %s\n", percentiles(measured.firstFrame))
+	fmt.Printf("frame latency:       %s\n", percentiles(measured.frameLatency))
+	fmt.Printf("chat latency:        %s (%d sent)\n", percentiles(measured.chatLatency), measured.chatSent)
+	for e, n := range measured.errors {
+		fmt.Printf("error: %s (x%d)\n", e, n)
+	}
+	measured.resyncs, measured.dropped, measured.chatSent = 0, 0, 0
+	measured.firstFrame, measured.frameLatency, measured.chatLatency = nil, nil, nil
+	measured.errors = make(map[string]int)
+	measured.Unlock()
+}
+
+func main() {
+	flag.Parse()
+	if *broadcasters <= 0 || *fps <= 0 || *gop <= 0 || *chunkSize <= 0 {
+		log.Fatal("-broadcasters, -fps, -gop, and -chunk must be positive")
+	}
+	http.DefaultTransport.(*http.Transport).MaxIdleConnsPerHost = *broadcasters + *viewers
+
+	for i := 0; i < *broadcasters; i++ {
+		go broadcast(i)
+	}
+	clients := *viewers + *chatters
+	for i := 0; i < clients; i++ {
+		delay := time.Duration(0)
+		if clients > 1 {
+			// give the streams a second to start
+			delay = time.Second + *ramp*time.Duration(i)/time.Duration(clients-1)
+		}
+		time.AfterFunc(delay, func(i int) func() {
+			return func() {
+				if i < *viewers {
+					watch(i, i%*broadcasters)
+				} else {
+					chat(i, i%*broadcasters)
+				}
+			}
+		}(i))
+	}
+
+	last := time.Now()
+	for end := last.Add(*duration); time.Now().Before(end); {
+		time.Sleep(*report)
+		now := time.Now()
+		printReport(now.Sub(last))
+		last = now
+	}
+}
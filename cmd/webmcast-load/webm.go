@@ -0,0 +1,172 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"io"
+	"time"
+)
+
+const (
+	tagEBML        = 0x1A45DFA3
+	tagSegment     = 0x18538067
+	tagInfo        = 0x1549A966
+	tagTracks      = 0x1654AE6B
+	tagCluster     = 0x1F43B675
+	tagTimecode    = 0xE7
+	tagSimpleBlock = 0xA3
+	tagBlockGroup  = 0xA0
+	tagBlock       = 0xA1
+	// Every synthetic block starts with a sequence number and the time it was generated.
+	framePrefixLength = 16
+)
+
+func appendID(buf []byte, id uint32) []byte {
+	switch {
+	case id >= 1<<24:
+		return append(buf, byte(id>>24), byte(id>>16), byte(id>>8), byte(id))
+	case id >= 1<<16:
+		return append(buf, byte(id>>16), byte(id>>8), byte(id))
+	case id >= 1<<8:
+		return append(buf, byte(id>>8), byte(id))
+	}
+	return append(buf, byte(id))
+}
+
+func appendTag(buf []byte, id uint32, data ...[]byte) []byte {
+	size := 0
+	for _, d := range data {
+		size += len(d)
+	}
+	buf = appendID(buf, id)
+	buf = append(buf, 0x01, 0, 0, 0, 0, 0, 0, 0)
+	binary.BigEndian.PutUint32(buf[len(buf)-4:], uint32(size))
+	for _, d := range data {
+		buf = append(buf, d...)
+	}
+	return buf
+}
+
+func appendUint(buf []byte, id uint32, x uint64) []byte {
+	var data [8]byte
+	binary.BigEndian.PutUint64(data[:], x)
+	return appendTag(buf, id, data[:])
+}
+
+// An endless synthetic video: one "VP8" track with fixed-size frames. The server
+// does not decode anything, so this is enough to exercise everything but the players.
+type generator struct {
+	fps     int
+	gop     int // frames per keyframe; each keyframe starts a new cluster
+	size    int // bytes per frame
+	seq     uint64
+	started time.Time
+}
+
+func (g *generator) Header() []byte {
+	header := appendTag(nil, tagEBML,
+		appendUint(nil, 0x4286, 1), appendUint(nil, 0x42F7, 1), appendUint(nil, 0x42F2, 4),
+		appendUint(nil, 0x42F3, 8), appendTag(nil, 0x4282, []byte("webm")),
+		appendUint(nil, 0x4287, 2), appendUint(nil, 0x4285, 2))
+	header = appendID(header, tagSegment)
+	header = append(header, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+	header = appendTag(header, tagInfo, appendUint(nil, 0x2AD7B1, 1000000),
+		appendTag(nil, 0x4D80, []byte("webmcast-load")), appendTag(nil, 0x5741, []byte("webmcast-load")))
+	video := appendTag(nil, 0xE0, appendUint(nil, 0xB0, 640), appendUint(nil, 0xBA, 360))
+	return appendTag(header, tagTracks, appendTag(nil, 0xAE,
+		appendUint(nil, 0xD7, 1), appendUint(nil, 0x73C5, 1), appendUint(nil, 0x83, 1),
+		appendTag(nil, 0x86, []byte("V_VP8")), video))
+}
+
+// The next frame, preceded by a cluster header if it is a keyframe. Blocks until
+// it is time to send it.
+func (g *generator) Next() []byte {
+	if g.started.IsZero() {
+		g.started = time.Now()
+	}
+	n := g.seq
+	g.seq++
+	timecode := n * 1000 / uint64(g.fps)
+	time.Sleep(time.Until(g.started.Add(time.Duration(timecode) * time.Millisecond)))
+
+	var out []byte
+	if n%uint64(g.gop) == 0 {
+		out = appendID(out, tagCluster)
+		out = append(out, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF)
+		out = appendUint(out, tagTimecode, timecode)
+	}
+	rel := timecode - (n-n%uint64(g.gop))*1000/uint64(g.fps)
+	block := make([]byte, 4+framePrefixLength, 4+framePrefixLength+g.size)
+	block[0], block[1], block[2] = 0x81, byte(rel>>8), byte(rel)
+	if n%uint64(g.gop) == 0 {
+		block[3] = 0x80
+	}
+	binary.BigEndian.PutUint64(block[4:], n)
+	binary.BigEndian.PutUint64(block[12:], uint64(time.Now().UnixNano()))
+	block = block[:cap(block)]
+	return appendTag(out, tagSimpleBlock, block)
+}
+
+func readVarint(r *bufio.Reader, keepMarker bool) (uint64, error) {
+	first, err := r.ReadByte()
+	if err != nil {
+		return 0, err
+	}
+	length := 1
+	for mask := byte(0x80); mask != 0 && first&mask == 0; mask >>= 1 {
+		length++
+	}
+	if length > 8 {
+		return 0, errors.New("invalid varint")
+	}
+	x := uint64(first)
+	if !keepMarker {
+		x &= 0xFF >> uint(length)
+	}
+	unknown := x == 0xFF>>uint(length)
+	for i := 1; i < length; i++ {
+		b, err := r.ReadByte()
+		if err != nil {
+			return 0, err
+		}
+		x = x<<8 | uint64(b)
+		unknown = unknown && b == 0xFF
+	}
+	if unknown && !keepMarker {
+		return 1<<64 - 1, nil
+	}
+	return x, nil
+}
+
+// Called for each block a viewer receives, with the contents of the block.
+type blockFunc func(block []byte)
+
+// Walk through a WebM stream, entering the Segment and Clusters and skipping
+// everything else. There are no size checks; the server is trusted.
+func readBlocks(r *bufio.Reader, f blockFunc) error {
+	for {
+		id, err := readVarint(r, true)
+		if err != nil {
+			return err
+		}
+		size, err := readVarint(r, false)
+		if err != nil {
+			return err
+		}
+		switch id {
+		case tagSegment, tagCluster, tagBlockGroup:
+			continue
+		case tagSimpleBlock, tagBlock:
+			block := make([]byte, size)
+			if _, err = io.ReadFull(r, block); err != nil {
+				return err
+			}
+			f(block)
+		default:
+			if _, err = r.Discard(int(size)); err != nil {
+				return err
+			}
+		}
+	}
+}
@@ -1,11 +1,26 @@
 package main
 
 import (
+	"container/list"
 	"github.com/gorilla/securecookie"
 	"net/http"
+	"sync"
 	"time"
 )
 
+const (
+	// how many decoded session cookies to remember.
+	sessionCacheSize = 8192
+	// how long to trust a remembered session; user data may be changed through other nodes.
+	sessionCacheTTL = time.Minute
+)
+
+type cachedSession struct {
+	cookie  string
+	user    *UserData
+	expires time.Time
+}
+
 type Context struct {
 	Database
 	// the key used to sign client-side secure session cookies.
@@ -15,31 +30,122 @@ type Context struct {
 	// how long to keep a stream online after the broadcaster has disconnected.
 	// if the stream does not resume within this time, all clients get dropped.
 	StreamKeepAlive time.Duration
+	// how many bytes of recent frames to keep for each stream. new viewers start from
+	// the last keyframe, so this should fit a whole GOP at the highest bitrate allowed.
+	StreamBufferSize int
+	// how long to let frames accumulate before sending them to a viewer. larger values
+	// mean fewer syscalls per viewer, but add up to this much latency.
+	StreamFlushInterval time.Duration
+	// the fraction of frames for which to measure how long each step from ingest to
+	// delivery takes (see /metrics.) 0 to disable.
+	StreamTraceSampling float64
+	// whether to serve viewers of streams online on other nodes by pulling a single
+	// copy from that node, rather than redirecting them all there.
+	StreamRelay bool
+	// whether to publish this node's load to the database, send new broadcasters to
+	// the least loaded node, and redirect viewers to nodes already relaying a stream.
+	StreamBalance bool
+	// node-wide limits; new broadcasters and viewers over them are turned away, or
+	// sent to another node with `StreamBalance`. 0 means no limit.
+	MaxIngestRate   float64 // bytes per second, as measured by `Broadcast.Rate`
+	MaxViewers      int
+	MaxBufferMemory int64 // bytes of frames buffered for viewers, plus an estimate per viewer
 
-	cookieCodec *securecookie.SecureCookie
+	cookieCodec     *securecookie.SecureCookie
+	cookieCodecInit sync.Once
+	// an LRU of `cachedSession`, most recently used first.
+	sessionLock  sync.Mutex
+	sessionList  list.List
+	sessionIndex map[string]*list.Element
 }
 
-func (c *Context) GetAuthInfo(r *http.Request) (*UserData, error) {
-	if c.cookieCodec == nil {
+func (c *Context) codec() *securecookie.SecureCookie {
+	c.cookieCodecInit.Do(func() {
 		c.cookieCodec = securecookie.New(c.SecureKey, nil)
+	})
+	return c.cookieCodec
+}
+
+func (c *Context) GetAuthInfo(r *http.Request) (*UserData, error) {
+	cookie, err := r.Cookie("uid")
+	if err != nil {
+		return nil, ErrUserNotExist
+	}
+	c.sessionLock.Lock()
+	if e, ok := c.sessionIndex[cookie.Value]; ok {
+		if s := e.Value.(*cachedSession); time.Now().Before(s.expires) {
+			c.sessionList.MoveToFront(e)
+			c.sessionLock.Unlock()
+			return s.user, nil
+		}
+		c.sessionList.Remove(e)
+		delete(c.sessionIndex, cookie.Value)
 	}
+	c.sessionLock.Unlock()
+
 	var uid int64
-	if cookie, err := r.Cookie("uid"); err == nil {
-		if err = c.cookieCodec.Decode("uid", cookie.Value, &uid); err == nil {
-			return c.GetUserFull(uid)
+	if err = c.codec().Decode("uid", cookie.Value, &uid); err != nil {
+		return nil, ErrUserNotExist
+	}
+	user, err := c.GetUserFull(uid)
+	if err != nil {
+		return user, err
+	}
+	c.sessionLock.Lock()
+	if c.sessionIndex == nil {
+		c.sessionIndex = make(map[string]*list.Element)
+	}
+	if _, ok := c.sessionIndex[cookie.Value]; !ok {
+		if c.sessionList.Len() >= sessionCacheSize {
+			delete(c.sessionIndex, c.sessionList.Remove(c.sessionList.Back()).(*cachedSession).cookie)
 		}
+		c.sessionIndex[cookie.Value] = c.sessionList.PushFront(&cachedSession{
+			cookie.Value, user, time.Now().Add(sessionCacheTTL),
+		})
 	}
-	return nil, ErrUserNotExist
+	c.sessionLock.Unlock()
+	return user, nil
+}
+
+// Forget all sessions of a user whose data has changed.
+func (c *Context) invalidateSessions(id int64) {
+	c.sessionLock.Lock()
+	for e := c.sessionList.Front(); e != nil; {
+		next := e.Next()
+		if s := e.Value.(*cachedSession); s.user.ID == id {
+			c.sessionList.Remove(e)
+			delete(c.sessionIndex, s.cookie)
+		}
+		e = next
+	}
+	c.sessionLock.Unlock()
+}
+
+func (c *Context) SetUserData(id int64, name string, login string, email string, about string, password []byte) (string, error) {
+	defer c.invalidateSessions(id)
+	return c.Database.SetUserData(id, name, login, email, about, password)
+}
+
+func (c *Context) ResetUserStep2(id int64, token string, password []byte) error {
+	defer c.invalidateSessions(id)
+	return c.Database.ResetUserStep2(id, token, password)
+}
+
+func (c *Context) ActivateUser(id int64, token string) error {
+	defer c.invalidateSessions(id)
+	return c.Database.ActivateUser(id, token)
+}
+
+func (c *Context) NewStreamToken(id int64) error {
+	defer c.invalidateSessions(id)
+	return c.Database.NewStreamToken(id)
 }
 
 func (c *Context) SetAuthInfo(w http.ResponseWriter, id int64) error {
 	if id == -1 {
 		http.SetCookie(w, &http.Cookie{Name: "uid", Value: "", Path: "/", MaxAge: 0})
 	} else {
-		if c.cookieCodec == nil {
-			c.cookieCodec = securecookie.New(c.SecureKey, nil)
-		}
-		enc, err := c.cookieCodec.Encode("uid", id)
+		enc, err := c.codec().Encode("uid", id)
 		if err != nil {
 			return err
 		}
@@ -125,3 +125,15 @@ func (d anonymousDAO) StartRecording(id string, filename string) (recid int64, s
 func (d anonymousDAO) StopRecording(id string, recid int64, size int64) error {
 	return nil
 }
+
+func (d anonymousDAO) DeleteRecording(id string, recid int64) error {
+	return nil
+}
+
+func (d anonymousDAO) SetNodeLoad(load *NodeLoad) error {
+	return nil
+}
+
+func (d anonymousDAO) GetOtherNodes() ([]NodeLoad, error) {
+	return nil, nil
+}
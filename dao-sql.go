@@ -2,10 +2,37 @@ package main
 
 import (
 	"database/sql"
+	"fmt"
+	"io"
+	"log"
 	"reflect"
+	"strings"
 	"sync"
+	"time"
 )
 
+const (
+	// How long to trust cached stream locations and metadata. Changes made through
+	// this node are seen immediately; changes made through others, after at most this long.
+	sqlCacheTTL = 5 * time.Second
+	// If more streams than this are cached, the cache is simply dropped.
+	sqlCacheMaxSize = 4096
+	// How often to write queued track info updates, all in one transaction.
+	sqlFlushInterval = 500 * time.Millisecond
+)
+
+type sqlCachedServer struct {
+	expires time.Time
+	server  string
+	err     error
+}
+
+type sqlCachedMeta struct {
+	expires time.Time
+	meta    *StreamMetadata
+	err     error
+}
+
 type sqlDAO struct {
 	sql.DB
 	// The string written to `streams.server` of streams owned by this server.
@@ -15,33 +42,56 @@ type sqlDAO struct {
 	// in a separate request, which may or may not overload the database...
 	streamTokenLock sync.RWMutex
 	streamTokens    map[string]string
+	// Stream locations and metadata (by login), which are requested by every viewer.
+	cacheLock   sync.RWMutex
+	serverCache map[string]sqlCachedServer
+	metaCache   map[string]sqlCachedMeta
+	metaOwners  map[int64]string
+	// Track info is sent every time a broadcaster reconnects, so it is written in batches
+	// by `flushLoop`, with only the latest update for each stream kept.
+	pendingLock   sync.Mutex
+	pendingTracks map[string]StreamTrackInfo
+	flushStop     chan struct{}
+	flushDone     chan struct{}
+	flushLatency  time.Duration
+	// Every viewer redirect looks at these, so they are cached too. (Shared with
+	// the callers of `GetOtherNodes`, so never modified, only replaced.)
+	nodesLock    sync.Mutex
+	nodes        []NodeLoad
+	nodesExpires time.Time
 
 	prepared struct {
-		UserExists      *sql.Stmt "select 1 from users where login = ? or email = ?"
-		NewUser         *sql.Stmt "insert into users(actoken, sectoken, name, login, email, pwhash) values(?, ?, ?, ?, ?, ?)"
-		NewStream       *sql.Stmt "insert into streams(user) values(?)"
-		ResetUser       *sql.Stmt "update users set rstoken = ? where id = ?"
-		ResetUserStep2  *sql.Stmt "update users set pwhash = ?, rstoken = null where id = ? and rstoken = ?"
-		ActivateUser    *sql.Stmt "update users set actoken = NULL where id = ? and actoken = ?"
-		GetUserID       *sql.Stmt "select id, pwhash from users where login = ?"
-		GetUserByEither *sql.Stmt "select id from users where login = ? or email = ?"
-		GetUserInfo     *sql.Stmt "select name, login, email, pwhash, about, actoken, sectoken from users where id = ?"
-		GetStreamInfo   *sql.Stmt "select users.id, users.name, about, email, streams.name, server, video, audio, width, height, nsfw, streams.id from users join streams on users.id = streams.user where login = ?"
-		SetStreamToken  *sql.Stmt "update users set sectoken = ? where id = ?"
-		SetStreamName   *sql.Stmt "update streams set name = ?, nsfw = ? where user = ?"
-		SetStreamTracks *sql.Stmt "update streams set video = ?, audio = ?, width = ?, height = ? where user in (select id from users where login = ?)"
-		GetStreamPanels *sql.Stmt "select text, image, created from panels where stream = ?"
-		AddStreamPanel  *sql.Stmt "insert into panels(stream, text) select id, ? from streams where user = ?"
-		SetStreamPanel  *sql.Stmt "update panels set text = ? where id in (select id from panels where stream in (select id from streams where user = ?) limit 1 offset ?)"
-		DelStreamPanel  *sql.Stmt "delete from panels where id in (select id from panels where stream in (select id from streams where user = ?) limit 1 offset ?)"
-		GetStreamAuth   *sql.Stmt "select server, sectoken, actoken is null from users join streams on users.id = streams.user where users.login = ?"
-		GetStreamServer *sql.Stmt "select server from streams where user in (select id from users where login = ?)"
-		SetStreamServer *sql.Stmt "update streams set server = ? where server is null and user in (select id from users where login = ? and actoken is null and sectoken = ?)"
-		DelStreamServer *sql.Stmt "update streams set server = null where user in (select id from users where login = ?)"
-		GetRecordings1  *sql.Stmt "select id, name, about, email, space_total from users where login = ?"
-		GetRecordings2  *sql.Stmt "select id, name, server, path, created, size from recordings where user = ? order by datetime(created) desc"
-		GetRecordPanels *sql.Stmt "select text, image, created from panels where stream = ? and datetime(created) <= datetime(?)"
-		GetRecording    *sql.Stmt "select users.id, users.name, about, email, recordings.name, server, video, audio, width, height, nsfw, path, size, created, stream from users join recordings on users.id = user where recordings.id = ?"
+		UserExists      *timedStmt "select 1 from users where login = ? or email = ?"
+		NewUser         *timedStmt "insert into users(actoken, sectoken, name, login, email, pwhash) values(?, ?, ?, ?, ?, ?)"
+		NewStream       *timedStmt "insert into streams(user) values(?)"
+		ResetUser       *timedStmt "update users set rstoken = ? where id = ?"
+		ResetUserStep2  *timedStmt "update users set pwhash = ?, rstoken = null where id = ? and rstoken = ?"
+		ActivateUser    *timedStmt "update users set actoken = NULL where id = ? and actoken = ?"
+		GetUserID       *timedStmt "select id, pwhash from users where login = ?"
+		GetUserByEither *timedStmt "select id from users where login = ? or email = ?"
+		GetUserInfo     *timedStmt "select name, login, email, pwhash, about, actoken, sectoken from users where id = ?"
+		GetStreamInfo   *timedStmt "select users.id, users.name, about, email, streams.name, server, video, audio, width, height, nsfw, streams.id from users join streams on users.id = streams.user where login = ?"
+		SetStreamToken  *timedStmt "update users set sectoken = ? where id = ?"
+		SetStreamName   *timedStmt "update streams set name = ?, nsfw = ? where user = ?"
+		SetStreamTracks *timedStmt "update streams set video = ?, audio = ?, width = ?, height = ? where user in (select id from users where login = ?)"
+		GetStreamPanels *timedStmt "select text, image, created from panels where stream = ?"
+		AddStreamPanel  *timedStmt "insert into panels(stream, text) select id, ? from streams where user = ?"
+		SetStreamPanel  *timedStmt "update panels set text = ? where id in (select id from panels where stream in (select id from streams where user = ?) limit 1 offset ?)"
+		DelStreamPanel  *timedStmt "delete from panels where id in (select id from panels where stream in (select id from streams where user = ?) limit 1 offset ?)"
+		GetStreamAuth   *timedStmt "select server, sectoken, actoken is null from users join streams on users.id = streams.user where users.login = ?"
+		GetStreamServer *timedStmt "select server from streams where user in (select id from users where login = ?)"
+		SetStreamServer *timedStmt "update streams set server = ? where server is null and user in (select id from users where login = ? and actoken is null and sectoken = ?)"
+		DelStreamServer *timedStmt "update streams set server = null where user in (select id from users where login = ?)"
+		GetRecordings1  *timedStmt "select id, name, about, email, space_total from users where login = ?"
+		GetRecordings2  *timedStmt "select id, name, server, path, created, size from recordings where user = ? order by datetime(created) desc"
+		GetRecordPanels *timedStmt "select text, image, created from panels where stream = ? and datetime(created) <= datetime(?)"
+		GetRecording    *timedStmt "select users.id, users.name, about, email, recordings.name, server, video, audio, width, height, nsfw, path, size, created, stream from users join recordings on users.id = user where recordings.id = ?"
+		GetRecordSpace  *timedStmt "select space_total - coalesce((select sum(size) from recordings where user = users.id), 0) from users where login = ?"
+		StartRecording  *timedStmt "insert into recordings(stream, user, video, audio, nsfw, width, height, name, server, path) select streams.id, users.id, video, audio, nsfw, width, height, streams.name, ?, ? from users join streams on users.id = streams.user where login = ?"
+		StopRecording   *timedStmt "update recordings set size = ? where id = ? and user in (select id from users where login = ?)"
+		DelRecording    *timedStmt "delete from recordings where id = ? and user in (select id from users where login = ?)"
+		SetNodeLoad     *timedStmt "insert or replace into nodes(server, ingest, egress, viewers, cpu, full, relays, updated) values(?, ?, ?, ?, ?, ?, ?, ?)"
+		GetOtherNodes   *timedStmt "select server, ingest, egress, viewers, cpu, full, relays, updated from nodes where server != ?"
 	}
 }
 
@@ -94,16 +144,36 @@ create table if not exists recordings (
     path       varchar(256) not null,
     created    datetime     not null default (datetime('now')),
     size       integer      not null default 0
+);
+
+create table if not exists nodes (
+    server     varchar(128) not null primary key,
+    ingest     real         not null,
+    egress     real         not null,
+    viewers    integer      not null,
+    cpu        real         not null,
+    full       boolean      not null,
+    relays     text         not null,
+    updated    integer      not null
 );`
 
 func NewSQLDatabase(localhost string, driver string, server string) (Database, error) {
 	db, err := sql.Open(driver, server)
 	if err == nil {
-		wrapped := &sqlDAO{DB: *db, localhost: localhost, streamTokens: make(map[string]string)}
+		wrapped := &sqlDAO{
+			DB:            *db,
+			localhost:     localhost,
+			streamTokens:  make(map[string]string),
+			pendingTracks: make(map[string]StreamTrackInfo),
+			flushStop:     make(chan struct{}),
+			flushDone:     make(chan struct{}),
+		}
+		wrapped.resetCache()
 		if err = wrapped.prepare(); err == nil {
+			go wrapped.flushLoop()
 			return wrapped, nil
 		}
-		wrapped.Close()
+		wrapped.DB.Close()
 	}
 	return nil, err
 }
@@ -119,11 +189,35 @@ func (d *sqlDAO) prepare() error {
 		if err != nil {
 			return err
 		}
-		v.Field(i).Set(reflect.ValueOf(stmt))
+		v.Field(i).Set(reflect.ValueOf(&timedStmt{Stmt: stmt}))
 	}
 	return nil
 }
 
+// Must be called with a write lock on the cache.
+func (d *sqlDAO) resetCache() {
+	d.serverCache = make(map[string]sqlCachedServer)
+	d.metaCache = make(map[string]sqlCachedMeta)
+	d.metaOwners = make(map[int64]string)
+}
+
+func (d *sqlDAO) invalidateStream(id string) {
+	d.cacheLock.Lock()
+	delete(d.serverCache, id)
+	delete(d.metaCache, id)
+	d.cacheLock.Unlock()
+}
+
+func (d *sqlDAO) invalidateUser(uid int64) {
+	d.cacheLock.Lock()
+	if id, ok := d.metaOwners[uid]; ok {
+		delete(d.serverCache, id)
+		delete(d.metaCache, id)
+		delete(d.metaOwners, uid)
+	}
+	d.cacheLock.Unlock()
+}
+
 func (d *sqlDAO) userExists(login string, email string) bool {
 	var i int
 	return d.prepared.UserExists.QueryRow(login, email).Scan(&i) != sql.ErrNoRows
@@ -269,6 +363,7 @@ func (d *sqlDAO) SetUserData(id int64, name string, login string, email string,
 		query += " and not exists(select 1 from streams where user = users.id and server is not null)"
 	}
 	r, err := d.Exec(query, params...)
+	d.invalidateUser(id)
 	if err != nil {
 		if (login != "" || email != "") && d.userExists(login, email) {
 			return "", ErrUserNotUnique
@@ -293,18 +388,22 @@ func (d *sqlDAO) NewStreamToken(id int64) error {
 }
 
 func (d *sqlDAO) SetStreamName(id int64, name string, nsfw bool) error {
+	defer d.invalidateUser(id)
 	return errOf(d.prepared.SetStreamName.Exec(name, nsfw, id))
 }
 
 func (d *sqlDAO) AddStreamPanel(id int64, text string) error {
+	defer d.invalidateUser(id)
 	return errOf(d.prepared.AddStreamPanel.Exec(text, id))
 }
 
 func (d *sqlDAO) SetStreamPanel(id int64, n int64, text string) error {
+	defer d.invalidateUser(id)
 	return errOf(d.prepared.SetStreamPanel.Exec(text, id, n))
 }
 
 func (d *sqlDAO) DelStreamPanel(id int64, n int64) error {
+	defer d.invalidateUser(id)
 	return errOf(d.prepared.DelStreamPanel.Exec(id, n))
 }
 
@@ -344,14 +443,34 @@ func (d *sqlDAO) StartStream(id string, token string) error {
 	d.streamTokenLock.Lock()
 	d.streamTokens[id] = expect
 	d.streamTokenLock.Unlock()
+	d.invalidateStream(id)
 	return nil
 }
 
+func (d *sqlDAO) OwnedStreams() map[string]string {
+	d.streamTokenLock.RLock()
+	defer d.streamTokenLock.RUnlock()
+	tokens := make(map[string]string, len(d.streamTokens))
+	for id, token := range d.streamTokens {
+		tokens[id] = token
+	}
+	return tokens
+}
+
+func (d *sqlDAO) AdoptStreams(tokens map[string]string) {
+	d.streamTokenLock.Lock()
+	for id, token := range tokens {
+		d.streamTokens[id] = token
+	}
+	d.streamTokenLock.Unlock()
+}
+
 func (d *sqlDAO) StopStream(id string) error {
 	d.streamTokenLock.Lock()
 	delete(d.streamTokens, id)
 	d.streamTokenLock.Unlock()
 	_, err := d.prepared.DelStreamServer.Exec(id)
+	d.invalidateStream(id)
 	return err
 }
 
@@ -363,6 +482,25 @@ func (d *sqlDAO) GetStreamServer(id string) (string, error) {
 	}
 	d.streamTokenLock.RUnlock()
 
+	d.cacheLock.RLock()
+	cached, ok := d.serverCache[id]
+	d.cacheLock.RUnlock()
+	if ok && time.Now().Before(cached.expires) {
+		return cached.server, cached.err
+	}
+	server, err := d.getStreamServer(id)
+	if err == nil || err == ErrStreamNotHere || err == ErrStreamOffline || err == ErrStreamNotExist {
+		d.cacheLock.Lock()
+		if len(d.serverCache) >= sqlCacheMaxSize {
+			d.resetCache()
+		}
+		d.serverCache[id] = sqlCachedServer{time.Now().Add(sqlCacheTTL), server, err}
+		d.cacheLock.Unlock()
+	}
+	return server, err
+}
+
+func (d *sqlDAO) getStreamServer(id string) (string, error) {
 	var server sql.NullString
 	err := d.prepared.GetStreamServer.QueryRow(id).Scan(&server)
 	if err == sql.ErrNoRows {
@@ -384,6 +522,34 @@ func (d *sqlDAO) GetStreamServer(id string) (string, error) {
 }
 
 func (d *sqlDAO) GetStreamMetadata(id string) (*StreamMetadata, error) {
+	d.cacheLock.RLock()
+	cached, ok := d.metaCache[id]
+	d.cacheLock.RUnlock()
+	if ok && time.Now().Before(cached.expires) {
+		if cached.meta == nil {
+			return nil, cached.err
+		}
+		meta := *cached.meta
+		return &meta, cached.err
+	}
+	meta, err := d.getStreamMetadata(id)
+	if err == nil || err == ErrStreamOffline || err == ErrStreamNotExist {
+		d.cacheLock.Lock()
+		if len(d.metaCache) >= sqlCacheMaxSize {
+			d.resetCache()
+		}
+		d.metaCache[id] = sqlCachedMeta{time.Now().Add(sqlCacheTTL), meta, err}
+		if meta != nil {
+			d.metaOwners[meta.OwnerID] = id
+			copied := *meta
+			meta = &copied
+		}
+		d.cacheLock.Unlock()
+	}
+	return meta, err
+}
+
+func (d *sqlDAO) getStreamMetadata(id string) (*StreamMetadata, error) {
 	var intId int
 	var server sql.NullString
 	meta := StreamMetadata{}
@@ -419,7 +585,140 @@ func (d *sqlDAO) loadPanelsFromRows(rows *sql.Rows) ([]StreamMetadataPanel, erro
 }
 
 func (d *sqlDAO) SetStreamTrackInfo(id string, info *StreamTrackInfo) error {
-	return errOf(d.prepared.SetStreamTracks.Exec(info.HasVideo, info.HasAudio, info.Width, info.Height, id))
+	d.pendingLock.Lock()
+	d.pendingTracks[id] = *info
+	d.pendingLock.Unlock()
+	return nil
+}
+
+func (d *sqlDAO) flushLoop() {
+	defer close(d.flushDone)
+	ticker := time.NewTicker(sqlFlushInterval)
+	defer ticker.Stop()
+	for {
+		stop := false
+		select {
+		case <-ticker.C:
+		case <-d.flushStop:
+			stop = true
+		}
+		if err := d.flush(); err != nil {
+			log.Println("Error writing stream metadata: ", err)
+		}
+		if stop {
+			return
+		}
+	}
+}
+
+func (d *sqlDAO) flush() error {
+	d.pendingLock.Lock()
+	pending := d.pendingTracks
+	if len(pending) == 0 {
+		d.pendingLock.Unlock()
+		return nil
+	}
+	d.pendingTracks = make(map[string]StreamTrackInfo, len(pending))
+	d.pendingLock.Unlock()
+
+	start := time.Now()
+	err := d.writeTracks(pending)
+	d.pendingLock.Lock()
+	if err != nil {
+		// Try again on the next tick, unless there is newer info by then.
+		for id, info := range pending {
+			if _, ok := d.pendingTracks[id]; !ok {
+				d.pendingTracks[id] = info
+			}
+		}
+	}
+	d.flushLatency = time.Since(start)
+	d.pendingLock.Unlock()
+	return err
+}
+
+func (d *sqlDAO) writeTracks(pending map[string]StreamTrackInfo) error {
+	tx, err := d.Begin()
+	if err != nil {
+		return err
+	}
+	stmt := tx.Stmt(d.prepared.SetStreamTracks.Stmt)
+	for id, info := range pending {
+		if _, err = stmt.Exec(info.HasVideo, info.HasAudio, info.Width, info.Height, id); err != nil {
+			tx.Rollback()
+			return err
+		}
+	}
+	if err = tx.Commit(); err != nil {
+		return err
+	}
+	for id := range pending {
+		d.invalidateStream(id)
+	}
+	return nil
+}
+
+// The number of streams with unwritten track info, and the time taken by the last write.
+func (d *sqlDAO) PendingWrites() (int, time.Duration) {
+	d.pendingLock.Lock()
+	defer d.pendingLock.Unlock()
+	return len(d.pendingTracks), d.flushLatency
+}
+
+func (d *sqlDAO) WriteMetrics(w io.Writer) {
+	pending, latency := d.PendingWrites()
+	fmt.Fprintf(w, "# TYPE webmcast_db_pending_writes gauge\nwebmcast_db_pending_writes %d\n", pending)
+	fmt.Fprintf(w, "# TYPE webmcast_db_flush_seconds gauge\nwebmcast_db_flush_seconds %g\n", latency.Seconds())
+	io.WriteString(w, "# TYPE webmcast_db_query_seconds histogram\n")
+	t := reflect.TypeOf(&d.prepared).Elem()
+	v := reflect.ValueOf(&d.prepared).Elem()
+	for i := 0; i < t.NumField(); i++ {
+		stmt := v.Field(i).Interface().(*timedStmt)
+		stmt.latency.WriteTo(w, "webmcast_db_query_seconds", "statement=\""+t.Field(i).Name+"\",")
+	}
+}
+
+func (d *sqlDAO) SetNodeLoad(load *NodeLoad) error {
+	return errOf(d.prepared.SetNodeLoad.Exec(d.localhost, load.Ingest, load.Egress, load.Viewers,
+		load.CPU, load.Full, strings.Join(load.Relays, "\n"), load.Updated.Unix()))
+}
+
+func (d *sqlDAO) GetOtherNodes() ([]NodeLoad, error) {
+	d.nodesLock.Lock()
+	defer d.nodesLock.Unlock()
+	if time.Now().Before(d.nodesExpires) {
+		return d.nodes, nil
+	}
+	rows, err := d.prepared.GetOtherNodes.Query(d.localhost)
+	if err != nil {
+		return nil, err
+	}
+	defer rows.Close()
+	nodes := []NodeLoad{}
+	for rows.Next() {
+		var n NodeLoad
+		var relays string
+		var updated int64
+		if err := rows.Scan(&n.Server, &n.Ingest, &n.Egress, &n.Viewers, &n.CPU, &n.Full, &relays, &updated); err != nil {
+			return nil, err
+		}
+		if relays != "" {
+			n.Relays = strings.Split(relays, "\n")
+		}
+		n.Updated = time.Unix(updated, 0)
+		nodes = append(nodes, n)
+	}
+	if err = rows.Err(); err != nil {
+		return nil, err
+	}
+	d.nodes, d.nodesExpires = nodes, time.Now().Add(sqlCacheTTL)
+	return nodes, nil
+}
+
+func (d *sqlDAO) Close() error {
+	close(d.flushStop)
+	<-d.flushDone
+	return d.DB.Close()
 }
 
 func (d *sqlDAO) GetRecordings(id string) (*StreamHistory, error) {
@@ -465,9 +764,24 @@ func (d *sqlDAO) GetRecording(id string, recid int64) (*StreamRecording, error)
 }
 
 func (d *sqlDAO) StartRecording(id string, filename string) (recid int64, sizeLimit int64, e error) {
-	return 0, 0, nil
+	err := d.prepared.GetRecordSpace.QueryRow(id).Scan(&sizeLimit)
+	if err == sql.ErrNoRows {
+		return 0, 0, ErrStreamNotExist
+	}
+	if err != nil || sizeLimit <= 0 {
+		return 0, 0, err
+	}
+	r, err := d.prepared.StartRecording.Exec(d.localhost, filename, id)
+	if err == nil {
+		recid, err = r.LastInsertId()
+	}
+	return recid, sizeLimit, err
 }
 
 func (d *sqlDAO) StopRecording(id string, recid int64, size int64) error {
-	return nil
+	return errOf(d.prepared.StopRecording.Exec(size, recid, id))
+}
+
+func (d *sqlDAO) DeleteRecording(id string, recid int64) error {
+	return errOf(d.prepared.DelRecording.Exec(recid, id))
 }
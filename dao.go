@@ -62,6 +62,18 @@ type StreamMetadata struct {
 	StreamTrackInfo
 }
 
+// How busy a node is, as last reported by it. See `Context.StreamBalance`.
+type NodeLoad struct {
+	Server  string
+	Ingest  float64 // bytes per second received from broadcasters
+	Egress  float64 // bytes per second sent to viewers (estimated from the above)
+	Viewers int
+	CPU     float64 // fraction of all cores busy
+	Full    bool    // over one of the limits in `Context`
+	Relays  []string
+	Updated time.Time
+}
+
 type StreamMetadataPanel struct {
 	Text    string
 	Image   string
@@ -186,7 +198,12 @@ type Database interface {
 	GetRecordings(id string) (*StreamHistory, error)
 	GetRecording(id string, recid int64) (*StreamRecording, error)
 	// TODO allow removing old recordings
-	// TODO think of how to implement this ---v
+	// v--- `sizeLimit` is the space the owner has left; there's no recording if it's <= 0
 	StartRecording(id string, filename string) (recid int64, sizeLimit int64, e error)
 	StopRecording(id string, recid int64, size int64) error
+	// v--- for when `StartRecording` succeeded, but nothing could be written
+	DeleteRecording(id string, recid int64) error
+	// v--- for cluster mode; `GetOtherNodes` does not include this node
+	SetNodeLoad(load *NodeLoad) error
+	GetOtherNodes() ([]NodeLoad, error)
 }
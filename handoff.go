@@ -0,0 +1,129 @@
+package main
+
+import (
+	"context"
+	"encoding/json"
+	"errors"
+	"log"
+	"net"
+	"net/http"
+	"os"
+	"os/exec"
+	"sync/atomic"
+	"time"
+)
+
+// On SIGUSR2, the process starts a copy of itself that inherits the listening socket,
+// so no connection is refused, and the streams this node owns, so broadcasters that
+// reconnect to it within `StreamKeepAlive` don't touch the database and viewers
+// elsewhere are not told the streams went offline. The old process then lets requests
+// in progress finish for up to `handoffDrainTimeout`; whatever is still connected after
+// that (i.e. broadcasters and viewers) has to reconnect.
+const (
+	// Set in the environment of the new process. Its file descriptor 3 is the listener,
+	// and 4 is a pipe with the JSON-encoded `handoffState`.
+	handoffEnv          = "WEBMCAST_HANDOFF"
+	handoffDrainTimeout = 10 * time.Second
+)
+
+type handoffState struct {
+	Streams map[string]string // id -> token
+}
+
+// Implemented by databases that remember the streams this node owns.
+type streamOwner interface {
+	OwnedStreams() map[string]string
+	AdoptStreams(tokens map[string]string)
+}
+
+// Create the listening socket, or take over the one of the process that started this one.
+func listen(bind string) (net.Listener, *handoffState, error) {
+	if os.Getenv(handoffEnv) == "" {
+		l, err := net.Listen("tcp", bind)
+		return l, nil, err
+	}
+	os.Unsetenv(handoffEnv)
+	f := os.NewFile(3, "listener")
+	l, err := net.FileListener(f)
+	f.Close()
+	if err != nil {
+		return nil, nil, err
+	}
+	state := &handoffState{}
+	pipe := os.NewFile(4, "state")
+	defer pipe.Close()
+	if err = json.NewDecoder(pipe).Decode(state); err != nil {
+		l.Close()
+		return nil, nil, err
+	}
+	return l, state, nil
+}
+
+// Take over the streams the previous process owned. Those whose broadcasters don't
+// come back are released once they would have timed out in the old process.
+func (ctx *RetransmissionHandler) Adopt(state *handoffState) {
+	db, ok := ctx.Database.(streamOwner)
+	if !ok || state == nil {
+		return
+	}
+	db.AdoptStreams(state.Streams)
+	for id := range state.Streams {
+		id := id
+		time.AfterFunc(handoffDrainTimeout+ctx.StreamKeepAlive, func() {
+			if _, ok := ctx.Readable(id); !ok {
+				if err := ctx.StopStream(id); err != nil {
+					log.Println("Error stopping the stream: ", err)
+				}
+			}
+		})
+	}
+}
+
+// Start the new process and stop accepting connections. `srv.Serve` returns
+// right after this; wait for `srv.Shutdown` to finish before exiting.
+func (ctx *RetransmissionHandler) Handoff(srv *http.Server, l net.Listener) (<-chan struct{}, error) {
+	tl, ok := l.(*net.TCPListener)
+	if !ok {
+		return nil, errors.New("not a TCP listener")
+	}
+	f, err := tl.File()
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	r, w, err := os.Pipe()
+	if err != nil {
+		return nil, err
+	}
+	defer r.Close()
+
+	// From now on, streams that end here are not considered offline.
+	atomic.StoreInt32(&ctx.handedOff, 1)
+	state := handoffState{}
+	if db, ok := ctx.Database.(streamOwner); ok {
+		state.Streams = db.OwnedStreams()
+	}
+	cmd := exec.Command(os.Args[0], os.Args[1:]...)
+	cmd.Stdout, cmd.Stderr = os.Stdout, os.Stderr
+	cmd.Env = append(os.Environ(), handoffEnv+"=1")
+	cmd.ExtraFiles = []*os.File{f, r}
+	if err = cmd.Start(); err != nil {
+		atomic.StoreInt32(&ctx.handedOff, 0)
+		w.Close()
+		return nil, err
+	}
+	err = json.NewEncoder(w).Encode(&state)
+	w.Close()
+	if err != nil {
+		log.Println("Error passing state to the new process: ", err)
+	}
+
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		timeout, cancel := context.WithTimeout(context.Background(), handoffDrainTimeout)
+		defer cancel()
+		srv.Shutdown(timeout)
+	}()
+	return done, nil
+}
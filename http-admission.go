@@ -0,0 +1,104 @@
+package main
+
+import (
+	"math"
+	"net/http"
+	"strconv"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	// Summing up rates and buffers means visiting every stream, so it's done
+	// at most this often. Viewers are counted exactly.
+	admissionUsageTTL = time.Second
+	// What a viewer costs in addition to the frames it shares with everyone else:
+	// batches, socket buffers, etc. Only a rough estimate.
+	admissionViewerMemory = 32 * 1024
+	// How long to tell clients that were turned away to wait.
+	admissionRetryAfter = 10 * time.Second
+)
+
+type nodeUsage struct {
+	Ingest  float64 // bytes per second
+	Buffers int64   // bytes of frames kept for viewers
+	Viewers int64
+}
+
+func (u *nodeUsage) Memory() int64 {
+	return u.Buffers + u.Viewers*admissionViewerMemory
+}
+
+func (ctx *RetransmissionHandler) Usage() nodeUsage {
+	ctx.usageLock.Lock()
+	defer ctx.usageLock.Unlock()
+	if time.Since(ctx.usageAt) > admissionUsageTTL {
+		u := nodeUsage{}
+		ctx.Streams(func(id string, cast *Broadcast) {
+			mean, _ := cast.Rate()
+			u.Ingest += mean
+			u.Buffers += int64(cast.BufferedBytes())
+		})
+		ctx.usage, ctx.usageAt = u, time.Now()
+	}
+	u := ctx.usage
+	u.Viewers = atomic.LoadInt64(&ctx.viewers)
+	return u
+}
+
+// Whether there is room for one more stream.
+func (ctx *RetransmissionHandler) admitIngest() bool {
+	u := ctx.Usage()
+	return (ctx.MaxIngestRate == 0 || u.Ingest < ctx.MaxIngestRate) &&
+		(ctx.MaxBufferMemory == 0 || u.Memory() < ctx.MaxBufferMemory)
+}
+
+// Whether there is room for one more viewer. If so, must be followed by `releaseViewer`.
+func (ctx *RetransmissionHandler) admitViewer() bool {
+	n := atomic.AddInt64(&ctx.viewers, 1)
+	if ctx.MaxViewers != 0 && n > int64(ctx.MaxViewers) {
+		ctx.releaseViewer()
+		return false
+	}
+	if ctx.MaxBufferMemory != 0 {
+		if u := ctx.Usage(); u.Memory() > ctx.MaxBufferMemory {
+			ctx.releaseViewer()
+			return false
+		}
+	}
+	return true
+}
+
+func (ctx *RetransmissionHandler) releaseViewer() {
+	atomic.AddInt64(&ctx.viewers, -1)
+}
+
+// Send a client that was not admitted to `server`, or tell it to come back later if "".
+func (ctx *RetransmissionHandler) reject(w http.ResponseWriter, r *http.Request, server string) error {
+	if server != "" {
+		http.Redirect(w, r, "//"+server+r.URL.RequestURI(), http.StatusTemporaryRedirect)
+		return nil
+	}
+	w.Header().Set("Retry-After", strconv.Itoa(int(admissionRetryAfter/time.Second)))
+	return RenderError(w, http.StatusServiceUnavailable, "This server is full.")
+}
+
+// The least loaded other node that can take a new stream, if load is being published.
+func (ctx *RetransmissionHandler) spareIngestNode() string {
+	if !ctx.StreamBalance {
+		return ""
+	}
+	best, bestScore := "", math.Inf(1)
+	for _, n := range ctx.liveNodes() {
+		if score := n.score(); score < bestScore {
+			best, bestScore = n.Server, score
+		}
+	}
+	return best
+}
+
+func (cast *Broadcast) BufferedBytes() int {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return cast.frames.size
+}
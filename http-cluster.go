@@ -0,0 +1,122 @@
+package main
+
+import (
+	"log"
+	"math"
+	"runtime"
+	"syscall"
+	"time"
+)
+
+const (
+	// How often each node writes its `NodeLoad` to the database.
+	nodeLoadInterval = 5 * time.Second
+	// Nodes that have not done so for this long are assumed to be down.
+	nodeLoadTimeout = 3 * nodeLoadInterval
+	// Nodes busier than this take no new broadcasters.
+	nodeMaxCPU = 0.9
+	// Broadcasters are only sent to nodes with at most this fraction of the local load,
+	// so that nodes with slightly outdated views of each other don't bounce them around.
+	nodeLoadMargin = 0.8
+)
+
+// What to compare nodes by. Bandwidth is what runs out first.
+func (n *NodeLoad) score() float64 {
+	if n.CPU > nodeMaxCPU || n.Full {
+		return math.Inf(1)
+	}
+	return n.Ingest + n.Egress
+}
+
+func (ctx *RetransmissionHandler) loadLoop() {
+	lastCPU, lastTime := cpuTime(), time.Now()
+	for range time.Tick(nodeLoadInterval) {
+		load := NodeLoad{Updated: time.Now()}
+		ctx.Streams(func(id string, cast *Broadcast) {
+			mean, _ := cast.Rate()
+			viewers := cast.ViewerCount()
+			load.Ingest += mean
+			load.Egress += mean * float64(viewers)
+			load.Viewers += viewers
+		})
+		ctx.relayLock.Lock()
+		for id := range ctx.relays {
+			load.Relays = append(load.Relays, id)
+		}
+		ctx.relayLock.Unlock()
+		cpu := cpuTime()
+		load.CPU = float64(cpu-lastCPU) / float64(load.Updated.Sub(lastTime)) / float64(runtime.NumCPU())
+		lastCPU, lastTime = cpu, load.Updated
+		load.Full = !ctx.admitIngest()
+
+		ctx.loadLock.Lock()
+		ctx.load = load
+		ctx.loadLock.Unlock()
+		if err := ctx.SetNodeLoad(&load); err != nil {
+			log.Println("Error publishing node load: ", err)
+		}
+	}
+}
+
+func cpuTime() time.Duration {
+	var usage syscall.Rusage
+	if syscall.Getrusage(syscall.RUSAGE_SELF, &usage) != nil {
+		return 0
+	}
+	return time.Duration(usage.Utime.Nano() + usage.Stime.Nano())
+}
+
+// Other nodes that are still alive.
+func (ctx *RetransmissionHandler) liveNodes() []NodeLoad {
+	nodes, err := ctx.GetOtherNodes()
+	if err != nil {
+		log.Println("Error reading node load: ", err)
+		return nil
+	}
+	live := []NodeLoad{}
+	for _, n := range nodes {
+		if time.Since(n.Updated) < nodeLoadTimeout {
+			live = append(live, n)
+		}
+	}
+	return live
+}
+
+// The node a broadcaster should publish a stream to, or "" for this one.
+func (ctx *RetransmissionHandler) ingestNode(id string) string {
+	if _, ok := ctx.Readable(id); ok && !ctx.IsRelayed(id) {
+		return "" // already here
+	}
+	base, _ := splitRendition(id) // all renditions must be on the same node
+	if server, err := ctx.GetStreamServer(base); err == ErrStreamNotHere {
+		return server
+	} else if err != ErrStreamOffline {
+		return "" // either this node has it, or `openIngest` will report the error
+	}
+
+	ctx.loadLock.Lock()
+	best, bestScore := "", ctx.load.score()*nodeLoadMargin
+	ctx.loadLock.Unlock()
+	for _, n := range ctx.liveNodes() {
+		if score := n.score(); score < bestScore {
+			best, bestScore = n.Server, score
+		}
+	}
+	return best
+}
+
+// The node to send viewers of a stream published on `origin` to: the least loaded
+// one that is relaying it already, or else the origin itself.
+func (ctx *RetransmissionHandler) viewerNode(id string, origin string) string {
+	best, bestScore := origin, math.Inf(1)
+	for _, n := range ctx.liveNodes() {
+		has := n.Server == origin
+		for i := 0; i < len(n.Relays) && !has; i++ {
+			has = n.Relays[i] == id
+		}
+		if score := n.score(); has && score < bestScore {
+			best, bestScore = n.Server, score
+		}
+	}
+	return best
+}
@@ -0,0 +1,70 @@
+package main
+
+import (
+	"io"
+	"sync"
+)
+
+// Some broadcasters send each frame as a separate request. Those that come while
+// the stream is still alive skip authentication and stream lookup entirely.
+type ingestSession struct {
+	cast  *Broadcast
+	token string
+}
+
+var ingestBuffers = sync.Pool{New: func() interface{} { return new([16384]byte) }}
+
+// Continue a stream that had a writer with this token before, if it is still alive.
+func (ctx *RetransmissionHandler) resumeIngest(id string, token string) *Broadcast {
+	ctx.ingestLock.Lock()
+	s, ok := ctx.ingests[id]
+	ctx.ingestLock.Unlock()
+	if ok && s.token == token && s.cast.Resume() {
+		return s.cast
+	}
+	return nil
+}
+
+// Authenticate the broadcaster and obtain a writable stream; see `resumeIngest`.
+func (ctx *RetransmissionHandler) openIngest(id string, token string) (*Broadcast, error) {
+	if cast := ctx.resumeIngest(id, token); cast != nil {
+		return cast, nil
+	}
+	base, _ := splitRendition(id)
+	if err := ctx.StartStream(base, token); err != nil {
+		return nil, err
+	}
+	cast, ok := ctx.Writable(id)
+	if !ok {
+		return nil, errStreamTaken
+	}
+	ctx.relayLock.Lock()
+	delete(ctx.relayed, id) // it's on this server now
+	ctx.relayLock.Unlock()
+	ctx.ingestLock.Lock()
+	ctx.ingests[id] = ingestSession{cast, token}
+	ctx.ingestLock.Unlock()
+	if id == base {
+		ctx.record(id, cast)
+	}
+	return cast, nil
+}
+
+// Write everything from a request body or a websocket into a stream.
+// Returns nil at EOF, or an error if the data is not a valid WebM.
+func (ctx *RetransmissionHandler) ingest(cast *Broadcast, r io.Reader) error {
+	buffer := ingestBuffers.Get().(*[16384]byte)
+	defer ingestBuffers.Put(buffer)
+	for {
+		n, err := r.Read(buffer[:])
+		if n != 0 {
+			if _, err := cast.Write(buffer[:n]); err != nil {
+				cast.Reset()
+				return err
+			}
+		}
+		if err != nil {
+			return nil
+		}
+	}
+}
@@ -0,0 +1,119 @@
+package main
+
+import (
+	"errors"
+	"golang.org/x/net/websocket"
+	"strings"
+	"sync"
+	"time"
+)
+
+// Methods of `Stream`, for players that feed a MediaSource with data received over
+// the same websocket as the chat instead of making a separate request.
+type streamRPC struct {
+	ctx    *RetransmissionHandler
+	id     string
+	cast   *Broadcast
+	socket *websocket.Conn
+	lock   sync.Mutex
+	viewer *adaptiveViewer
+	stop   chan struct{}
+	filter trackFilter
+}
+
+// Only send some of the tracks (see `parseTrackFilter`), e.g. `audio`. Must be
+// called before `Watch`.
+func (s *streamRPC) SetTracks(args *RPCSingleStringArg, _ *interface{}) error {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if s.viewer != nil {
+		return errors.New("already watching")
+	}
+	filter, err := parseTrackFilter(args.First)
+	if err == nil {
+		s.filter = filter
+	}
+	return err
+}
+
+// Start sending the stream as binary messages, one per batch. Returns the MIME type
+// to create a `SourceBuffer` with. The first message contains the EBML header
+// and the tracks, like the beginning of a response to a plain GET.
+func (s *streamRPC) Watch(_ *[]interface{}, mimeType *string) error {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if s.viewer != nil {
+		return errors.New("already watching")
+	}
+	if !s.ctx.admitViewer() {
+		return errors.New("server is full")
+	}
+	s.viewer, s.stop = s.ctx.Connect(s.id, s.cast), make(chan struct{})
+	s.viewer.SelectTracks(s.filter)
+	*mimeType = s.viewer.MimeType()
+	go s.run(s.viewer, s.stop)
+	return nil
+}
+
+// Stop sending the stream, e.g. because the player can't play it and will make
+// a plain HTTP request instead.
+func (s *streamRPC) Unwatch(_ *[]interface{}, _ *interface{}) error {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if s.viewer == nil {
+		return errors.New("not watching")
+	}
+	close(s.stop)
+	s.viewer, s.stop = nil, nil
+	return nil
+}
+
+func (s *streamRPC) run(cb *adaptiveViewer, stop <-chan struct{}) {
+	defer s.ctx.releaseViewer()
+	defer cb.Disconnect()
+	buf := []byte{}
+	for chunks, ok := cb.Read(nil); ok; chunks, ok = cb.Read(chunks[:0]) {
+		select {
+		case <-stop:
+			return
+		default:
+		}
+		// Each message is a single frame, and the chat may send its own in between.
+		// So the batch is copied rather than streamed.
+		buf = buf[:0]
+		for _, chunk := range chunks {
+			buf = append(buf, chunk...)
+		}
+		if err := websocket.Message.Send(s.socket, buf); err != nil {
+			return
+		}
+		cb.Sent()
+		time.Sleep(s.ctx.StreamFlushInterval)
+	}
+	// Otherwise, the viewer is gone and this will fail too.
+	RPCPushEvent(s.socket, "Stream.Ended")
+}
+
+func (cast *Broadcast) MimeType() string {
+	cast.vlock.RLock()
+	defer cast.vlock.RUnlock()
+	return cast.mimeType
+}
+
+// Translate a Matroska codec ID into something `MediaSource.isTypeSupported` understands.
+func mseCodecName(id string) string {
+	switch id {
+	case "V_VP8":
+		return "vp8"
+	case "V_VP9":
+		return "vp9"
+	case "A_VORBIS":
+		return "vorbis"
+	case "A_OPUS":
+		return "opus"
+	}
+	if i := strings.IndexByte(id, '_'); i != -1 {
+		id = id[i+1:]
+	}
+	return strings.ToLower(id)
+}
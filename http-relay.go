@@ -0,0 +1,118 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"log"
+	"net/http"
+)
+
+var errRelayNotNeeded = errors.New("stream is being published on this server")
+
+// A local copy of a stream that is online on another server. It is fed by a single
+// request to the origin for as long as anyone here is watching it.
+type streamRelay struct {
+	id      string
+	cast    *Broadcast
+	viewers int
+	err     error
+	stop    context.CancelFunc
+	ready   chan struct{} // closed once the upstream request has been made (see `err`)
+	done    chan struct{} // closed once the stream is not being fed anymore
+}
+
+func (ctx *RetransmissionHandler) IsRelayed(id string) bool {
+	ctx.relayLock.Lock()
+	_, ok := ctx.relayed[id]
+	ctx.relayLock.Unlock()
+	return ok
+}
+
+// Start watching a stream from another server. Must be followed by `releaseRelay`.
+func (ctx *RetransmissionHandler) acquireRelay(id string, server string) (*streamRelay, error) {
+	ctx.relayLock.Lock()
+	r, ok := ctx.relays[id]
+	for ok && r.viewers == 0 {
+		// The last viewer has just left; a new request has to be made after the old one ends.
+		ctx.relayLock.Unlock()
+		<-r.done
+		ctx.relayLock.Lock()
+		r, ok = ctx.relays[id]
+	}
+	if ok {
+		r.viewers++
+		ctx.relayLock.Unlock()
+		if <-r.ready; r.err != nil {
+			ctx.releaseRelay(r)
+			return nil, r.err
+		}
+		return r, nil
+	}
+
+	cast, ok := ctx.Writable(id)
+	if !ok {
+		ctx.relayLock.Unlock()
+		return nil, errRelayNotNeeded
+	}
+	upstream, stop := context.WithCancel(context.Background())
+	r = &streamRelay{id: id, cast: cast, viewers: 1, stop: stop, ready: make(chan struct{}), done: make(chan struct{})}
+	ctx.relays[id] = r
+	ctx.relayed[id] = struct{}{}
+	ctx.relayLock.Unlock()
+
+	req, err := http.NewRequest("GET", "http://"+server+"/stream/"+id, nil)
+	var rsp *http.Response
+	if err == nil {
+		if rsp, err = http.DefaultClient.Do(req.WithContext(upstream)); err == nil && rsp.StatusCode != http.StatusOK {
+			rsp.Body.Close()
+			err = errors.New("origin responded with " + rsp.Status)
+		}
+	}
+	if r.err = err; err != nil {
+		close(r.ready)
+		ctx.finishRelay(r)
+		ctx.releaseRelay(r)
+		return nil, err
+	}
+	close(r.ready)
+
+	go func() {
+		defer ctx.finishRelay(r)
+		defer rsp.Body.Close()
+		buffer := [16384]byte{}
+		for {
+			n, err := rsp.Body.Read(buffer[:])
+			if n != 0 {
+				if _, err := cast.Write(buffer[:n]); err != nil {
+					log.Println("Error relaying ", id, " from ", server, ": ", err)
+					cast.Reset()
+					return
+				}
+			}
+			if err != nil {
+				return
+			}
+		}
+	}()
+	return r, nil
+}
+
+func (ctx *RetransmissionHandler) releaseRelay(r *streamRelay) {
+	ctx.relayLock.Lock()
+	if r.viewers--; r.viewers == 0 {
+		r.stop()
+	}
+	ctx.relayLock.Unlock()
+}
+
+// Called once the upstream request is over. Like with a broadcaster disconnecting,
+// the local copy stays around for `StreamKeepAlive` in case it comes back.
+func (ctx *RetransmissionHandler) finishRelay(r *streamRelay) {
+	ctx.relayLock.Lock()
+	if ctx.relays[r.id] == r {
+		delete(ctx.relays, r.id)
+	}
+	r.cast.Close()
+	close(r.done)
+	ctx.relayLock.Unlock()
+}
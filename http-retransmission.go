@@ -7,11 +7,18 @@
 //     Otherwise any connected decoders will error and have to restart. Changing,
 //     for example, bitrate or tags is fine.)
 //
-// GET /stream/<name>
+// GET /stream/<name>[?tracks=<list>]
 //     Receive a published WebM stream. Note that the server makes no attempt
 //     at buffering; if the stream is being broadcast faster than its native framerate,
 //     the client will have to buffer and/or drop frames.
 //
+//     `tracks` is a comma-separated list of `audio`, `video`, and track numbers
+//     to receive instead of everything, e.g. `?tracks=audio` for an audio-only stream.
+//
+// GET /stream/<name>?<token> [Upgrade: websocket]
+//     Broadcast a WebM over a websocket instead, as binary messages split in any way.
+//     Emits an `RPC.Error(string)` notification if the data is invalid.
+//
 // GET /stream/<name> [Upgrade: websocket]
 //     Connect to a JSON-RPC v2.0 node.
 //
@@ -19,49 +26,111 @@
 //
 //        * `SetName(string)`: assign a (unique) name to this client. This is required to...
 //        * `SendMessage(string)`: broadcast a simple text message to all viewers.
-//        * `RequestHistory()`: ask the server to emit notifications containing the last
-//          few broadcasted text messages.
 //
-//     TODO Methods of `Stream`.
+//     Methods of `Stream`:
+//
+//        * `SetTracks(string)`: same as the `tracks` parameter above. Only valid before `Watch`.
+//        * `Watch() string`: start sending the stream as binary messages on this
+//          websocket. Returns the MIME type for `MediaSource.addSourceBuffer`.
+//          The messages can be appended to a `SourceBuffer` in the order they arrive.
+//        * `Unwatch()`: stop sending the stream on this websocket.
 //
 //     Notifications:
 //
 //        * `Chat.AcquiredName(user string)`: upon a successful `SetName`.
 //          May be emitted automatically at the start of a connection if already logged in.
 //        * `Chat.Message(user string, text string)`: a broadcasted text message.
+//        * `Chat.History([][user string, text string, login string])`: the last few
+//          messages, oldest first, as a single notification sent automatically
+//          at the start of a connection (unless there are none yet.)
+//        * `Stream.ViewerCount(int)`: the number of people watching; only sent when it changes.
+//        * `Stream.Ended()`: after `Watch`, the stream has gone offline.
 //
 package main
 
 import (
+	"errors"
 	"golang.org/x/net/websocket"
 	"log"
+	"net"
 	"net/http"
+	"strconv"
 	"strings"
 	"sync"
+	"sync/atomic"
+	"time"
 )
 
 type RetransmissionHandler struct {
 	BroadcastSet
-	chatLock sync.Mutex
-	chats    map[string]*Chat
+	chatLock  sync.Mutex
+	chats     map[string]*Chat
+	relayLock sync.Mutex
+	relays    map[string]*streamRelay
+	relayed   map[string]struct{} // local copies of other servers' streams, fed or not
+	// streams that are being written to disk.
+	recordLock sync.Mutex
+	recording  map[*Broadcast]struct{}
+	ingestLock sync.Mutex
+	ingests    map[string]ingestSession
+	// this node's `NodeLoad` as of the last time it was published.
+	loadLock sync.Mutex
+	load     NodeLoad
+	// 1 once another process has taken over this one's streams. See `Handoff`.
+	handedOff int32
+	// see `Usage`.
+	viewers   int64
+	usageLock sync.Mutex
+	usage     nodeUsage
+	usageAt   time.Time
 	*Context
 }
 
 func NewRetransmissionHandler(c *Context) *RetransmissionHandler {
-	ctx := &RetransmissionHandler{chats: make(map[string]*Chat), Context: c}
+	ctx := &RetransmissionHandler{
+		chats:     make(map[string]*Chat),
+		relays:    make(map[string]*streamRelay),
+		relayed:   make(map[string]struct{}),
+		recording: make(map[*Broadcast]struct{}),
+		ingests:   make(map[string]ingestSession),
+		Context:   c,
+	}
 	ctx.Timeout = c.StreamKeepAlive
+	ctx.BufferSize = c.StreamBufferSize
+	if c.StreamTraceSampling > 0 {
+		ctx.TraceEvery = uint64(1/c.StreamTraceSampling + 0.5)
+	}
+	if c.StreamBalance {
+		go ctx.loadLoop()
+	}
 	ctx.OnStreamClose = func(id string) {
+		ctx.ingestLock.Lock()
+		delete(ctx.ingests, id)
+		ctx.ingestLock.Unlock()
+		ctx.relayLock.Lock()
+		_, relayed := ctx.relayed[id]
+		delete(ctx.relayed, id)
+		ctx.relayLock.Unlock()
+		if _, n := splitRendition(id); n != -1 || relayed {
+			return // the original stream owns the chat and the database entry
+		}
 		ctx.chatLock.Lock()
 		if chat, ok := ctx.chats[id]; ok {
 			chat.Close()
 			delete(ctx.chats, id)
 		}
 		ctx.chatLock.Unlock()
+		if atomic.LoadInt32(&ctx.handedOff) != 0 {
+			return // the new process owns it now
+		}
 		if err := ctx.StopStream(id); err != nil {
 			log.Println("Error stopping the stream: ", err)
 		}
 	}
 	ctx.OnStreamTrackInfo = func(id string, info *StreamTrackInfo) {
+		if ctx.IsRelayed(id) {
+			return
+		}
 		if err := ctx.SetStreamTrackInfo(id, info); err != nil {
 			log.Println("Error setting stream metadata: ", err)
 		}
@@ -73,6 +142,8 @@ func (ctx *RetransmissionHandler) ServeHTTP(w http.ResponseWriter, r *http.Reque
 	switch {
 	case r.URL.Path == "/stream/" || strings.ContainsRune(r.URL.Path[8:], '/'):
 		return RenderError(w, http.StatusNotFound, "")
+	case r.Method == "GET" && r.URL.RawQuery != "" && wantsWebsocket(r):
+		return ctx.stream(w, r, r.URL.Path[8:])
 	case r.Method == "GET":
 		return ctx.watch(w, r, r.URL.Path[8:])
 	case r.Method == "POST" || r.Method == "PUT":
@@ -94,22 +165,45 @@ func wantsWebsocket(r *http.Request) bool {
 }
 
 func (ctx *RetransmissionHandler) watch(w http.ResponseWriter, r *http.Request, id string) error {
-	if r.URL.RawQuery != "" {
+	query := r.URL.Query()
+	filter, err := parseTrackFilter(query.Get("tracks"))
+	if delete(query, "tracks"); err != nil || len(query) != 0 {
 		return RenderError(w, http.StatusBadRequest, "Send WebMs here, watch using the other links.")
 	}
 
 	stream, ok := ctx.Readable(id)
+	if ok && ctx.IsRelayed(id) {
+		ok = false // viewers must be counted, see below
+	}
 	if !ok {
-		switch server, err := ctx.GetStreamServer(id); err {
+		base, _ := splitRendition(id)
+		switch server, err := ctx.GetStreamServer(base); err {
 		case ErrStreamNotHere:
 			if wantsWebsocket(r) {
 				// simply redirecting won't do -- browsers will throw an error.
+				// (in relay mode, too: the chat is only on the origin server.)
 				websocket.Handler(func(ws *websocket.Conn) {
 					RPCPushEvent(ws, "RPC.Redirect", "//"+server+r.URL.Path)
 				}).ServeHTTP(w, r)
 				return nil
 			}
-			http.Redirect(w, r, "//"+server+r.URL.Path, http.StatusTemporaryRedirect)
+			if ctx.StreamRelay {
+				relay, err := ctx.acquireRelay(id, server)
+				if err == nil {
+					defer ctx.releaseRelay(relay)
+					stream = relay.cast
+					break
+				}
+				if err != errRelayNotNeeded {
+					log.Println("Error relaying ", id, " from ", server, ": ", err)
+				} else if stream, ok = ctx.Readable(id); ok {
+					break
+				}
+			}
+			if ctx.StreamBalance {
+				server = ctx.viewerNode(id, server)
+			}
+			http.Redirect(w, r, "//"+server+r.URL.RequestURI(), http.StatusTemporaryRedirect)
 			return nil
 		case ErrStreamOffline, nil:
 			return RenderError(w, http.StatusNotFound, "Stream offline.")
@@ -125,74 +219,195 @@ func (ctx *RetransmissionHandler) watch(w http.ResponseWriter, r *http.Request,
 		if err != nil && err != ErrUserNotExist {
 			return err
 		}
+		base, _ := splitRendition(id) // all renditions share a chat
 		websocket.Handler(func(ws *websocket.Conn) {
 			ctx.chatLock.Lock()
-			chat, ok := ctx.chats[id]
+			chat, ok := ctx.chats[base]
 			if !ok {
-				chat = NewChat(20)
-				ctx.chats[id] = chat
+				chat = NewChat(20, func() int {
+					n := 0
+					for _, cast := range ctx.Renditions(id) {
+						n += cast.ViewerCount()
+					}
+					return n
+				})
+				ctx.chats[base] = chat
 			}
 			ctx.chatLock.Unlock()
-			chat.RunRPC(ws, auth)
+			chat.RunRPC(ws, auth, &streamRPC{ctx: ctx, id: id, cast: stream, socket: ws})
 		}).ServeHTTP(w, r)
 		return nil
 	}
 
+	if !ctx.admitViewer() {
+		server := ""
+		if ctx.StreamBalance {
+			server = ctx.viewerNode(id, "")
+		}
+		return ctx.reject(w, r, server)
+	}
+	defer ctx.releaseViewer()
+
+	cb := ctx.Connect(id, stream)
+	defer cb.Disconnect()
+	contentType := "video/webm"
+	if filter != (trackFilter{}) {
+		cb.SelectTracks(filter)
+		contentType = cb.MimeType()
+	}
+
 	header := w.Header()
 	header.Set("Access-Control-Allow-Origin", "*")
 	header.Set("Cache-Control", "no-cache")
-	header.Set("Content-Type", "video/webm")
-	w.WriteHeader(http.StatusOK)
-	f, flushable := w.(http.Flusher)
+	header.Set("Content-Type", contentType)
+	out, err := newBatchWriter(w, r)
+	if err != nil {
+		return err
+	}
+	defer out.Close()
 
-	ch := make(chan []byte, 240)
-	defer close(ch)
+	for chunks, ok := cb.Read(nil); ok; chunks, ok = cb.Read(chunks[:0]) {
+		if err := out.WriteBatch(chunks); err != nil {
+			break
+		}
+		cb.Sent()
+		// Whatever arrives in the meantime will be sent in one go on the next iteration.
+		time.Sleep(ctx.StreamFlushInterval)
+	}
+	return nil
+}
 
-	stream.Connect(ch, false)
-	defer stream.Disconnect(ch)
+type batchWriter interface {
+	// Send a sequence of chunks to the client, all at once.
+	WriteBatch(chunks [][]byte) error
+	Close() error
+}
 
-	for chunk := range ch {
-		if _, err := w.Write(chunk); err != nil || stream.Closed {
-			break
+// A fallback for HTTP/1.0 and HTTP/2: one `Write` per chunk, one `Flush` per batch.
+type flushingWriter struct {
+	http.ResponseWriter
+}
+
+// An HTTP/1.1 connection that encodes each batch as a single chunk and sends
+// it with a single vectored write.
+type chunkedWriter struct {
+	conn   net.Conn
+	prefix []byte
+	bufs   net.Buffers
+}
+
+func newBatchWriter(w http.ResponseWriter, r *http.Request) (batchWriter, error) {
+	if h, ok := w.(http.Hijacker); ok && r.ProtoAtLeast(1, 1) {
+		conn, _, err := h.Hijack()
+		if err != nil {
+			return nil, err
+		}
+		headers := "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n"
+		for k, vs := range w.Header() {
+			for _, v := range vs {
+				headers += k + ": " + v + "\r\n"
+			}
 		}
-		if flushable {
-			f.Flush()
+		conn.SetWriteDeadline(time.Now().Add(chunkedWriterTimeout))
+		if _, err = conn.Write([]byte(headers + "\r\n")); err != nil {
+			conn.Close()
+			return nil, err
 		}
+		return &chunkedWriter{conn: conn, prefix: make([]byte, 0, 18)}, nil
 	}
+	w.WriteHeader(http.StatusOK)
+	return flushingWriter{w}, nil
+}
+
+func (w flushingWriter) WriteBatch(chunks [][]byte) error {
+	for _, chunk := range chunks {
+		if _, err := w.Write(chunk); err != nil {
+			return err
+		}
+	}
+	if f, ok := w.ResponseWriter.(http.Flusher); ok {
+		f.Flush()
+	}
+	return nil
+}
+
+func (w flushingWriter) Close() error {
 	return nil
 }
 
+var chunkedWriterSuffix = []byte("\r\n")
+
+// The server no longer times out hijacked connections, so this is how long a batch
+// may take to send before the viewer is assumed to have stopped reading.
+const chunkedWriterTimeout = 5 * time.Second
+
+func (w *chunkedWriter) WriteBatch(chunks [][]byte) error {
+	size := 0
+	for _, chunk := range chunks {
+		size += len(chunk)
+	}
+	if size == 0 {
+		return nil // a zero-length chunk would end the response
+	}
+	w.prefix = append(strconv.AppendUint(w.prefix[:0], uint64(size), 16), '\r', '\n')
+	w.bufs = append(append(append(w.bufs[:0], w.prefix), chunks...), chunkedWriterSuffix)
+	bufs := w.bufs // `WriteTo` consumes its receiver.
+	w.conn.SetWriteDeadline(time.Now().Add(chunkedWriterTimeout))
+	_, err := bufs.WriteTo(w.conn)
+	return err
+}
+
+func (w *chunkedWriter) Close() error {
+	w.conn.SetWriteDeadline(time.Now().Add(chunkedWriterTimeout))
+	w.conn.Write([]byte("0\r\n\r\n"))
+	return w.conn.Close()
+}
+
+var errStreamTaken = errors.New("Stream ID already taken.")
+
 func (ctx *RetransmissionHandler) stream(w http.ResponseWriter, r *http.Request, id string) error {
-	switch err := ctx.StartStream(id, r.URL.RawQuery); err {
+	if ctx.StreamBalance && !wantsWebsocket(r) {
+		// 307 means the body is sent again to the new location. (Websockets can't be redirected.)
+		if server := ctx.ingestNode(id); server != "" {
+			http.Redirect(w, r, "//"+server+r.URL.RequestURI(), http.StatusTemporaryRedirect)
+			return nil
+		}
+	}
+	if _, ok := ctx.Readable(id); (!ok || ctx.IsRelayed(id)) && !ctx.admitIngest() {
+		server := ""
+		if !wantsWebsocket(r) {
+			server = ctx.spareIngestNode()
+		}
+		return ctx.reject(w, r, server)
+	}
+	stream, err := ctx.openIngest(id, r.URL.RawQuery)
+	switch err {
 	case ErrInvalidToken:
 		return RenderError(w, http.StatusForbidden, "Invalid token.")
 	case ErrStreamNotExist:
 		return RenderError(w, http.StatusNotFound, "Invalid stream ID.")
 	case ErrStreamNotHere:
 		return RenderError(w, http.StatusBadRequest, "Wrong server.")
+	case errStreamTaken:
+		return RenderError(w, http.StatusForbidden, err.Error())
 	default:
 		return err
 	case nil:
 	}
-
-	stream, ok := ctx.Writable(id)
-	if !ok {
-		return RenderError(w, http.StatusForbidden, "Stream ID already taken.")
-	}
 	defer stream.Close()
 
-	buffer := [16384]byte{}
-	for {
-		n, err := r.Body.Read(buffer[:])
-		if n != 0 {
-			if _, err := stream.Write(buffer[:n]); err != nil {
-				stream.Reset()
-				return RenderError(w, http.StatusBadRequest, err.Error())
+	if wantsWebsocket(r) {
+		// There's no Origin check; the token is enough, and most clients won't be browsers.
+		websocket.Server{Handler: func(ws *websocket.Conn) {
+			if err := ctx.ingest(stream, ws); err != nil {
+				RPCPushEvent(ws, "RPC.Error", err.Error())
 			}
-		}
-		if err != nil {
-			w.WriteHeader(http.StatusNoContent)
-			return nil
-		}
+		}}.ServeHTTP(w, r)
+		return nil
 	}
+	if err = ctx.ingest(stream, r.Body); err != nil {
+		return RenderError(w, http.StatusBadRequest, err.Error())
+	}
+	w.WriteHeader(http.StatusNoContent)
+	return nil
 }
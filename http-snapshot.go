@@ -0,0 +1,97 @@
+// GET /snapshot/<name>
+//     A short WebM with only the last keyframe of a stream, for previews.
+//     Supports `If-None-Match`; the ETag changes with each new keyframe.
+//
+package main
+
+import (
+	"net/http"
+	"strconv"
+	"strings"
+)
+
+type SnapshotHandler struct {
+	*RetransmissionHandler
+}
+
+func (ctx SnapshotHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) error {
+	if r.Method != "GET" && r.Method != "HEAD" {
+		return RenderInvalidMethod(w, "GET, HEAD")
+	}
+	id := r.URL.Path[10:]
+	if id == "" || strings.ContainsRune(id, '/') {
+		return RenderError(w, http.StatusNotFound, "")
+	}
+
+	stream, ok := ctx.Readable(id)
+	if !ok {
+		base, _ := splitRendition(id)
+		switch server, err := ctx.GetStreamServer(base); err {
+		case ErrStreamNotHere:
+			http.Redirect(w, r, "//"+server+r.URL.Path, http.StatusTemporaryRedirect)
+			return nil
+		case ErrStreamOffline, nil:
+			return RenderError(w, http.StatusNotFound, "Stream offline.")
+		case ErrStreamNotExist:
+			return RenderError(w, http.StatusNotFound, "Invalid stream name.")
+		default:
+			return err
+		}
+	}
+
+	data, tag := stream.Snapshot()
+	if data == nil {
+		return RenderError(w, http.StatusNotFound, "No keyframes yet.")
+	}
+	header := w.Header()
+	header.Set("Access-Control-Allow-Origin", "*")
+	// Previews are refreshed often, but mostly get a 304.
+	header.Set("Cache-Control", "no-cache")
+	header.Set("ETag", tag)
+	if r.Header.Get("If-None-Match") == tag {
+		w.WriteHeader(http.StatusNotModified)
+		return nil
+	}
+	header.Set("Content-Type", "video/webm")
+	header.Set("Content-Length", strconv.Itoa(len(data)))
+	w.WriteHeader(http.StatusOK)
+	if r.Method == "GET" {
+		w.Write(data)
+	}
+	return nil
+}
+
+// The stream's headers followed by its last keyframe, and an ETag for them. Rebuilt
+// on the first request after a new keyframe is pushed. Nil if there is no keyframe.
+func (cast *Broadcast) Snapshot() ([]byte, string) {
+	cast.vlock.RLock()
+	seq, ok := cast.frames.LastKeyframe()
+	if !ok || cast.Closed {
+		cast.vlock.RUnlock()
+		return nil, ""
+	}
+	if cast.snapshotSeq == seq+1 {
+		defer cast.vlock.RUnlock()
+		return cast.snapshot, cast.snapshotTag
+	}
+	cast.vlock.RUnlock()
+
+	cast.vlock.Lock()
+	defer cast.vlock.Unlock()
+	if seq, ok = cast.frames.LastKeyframe(); !ok || cast.Closed {
+		return nil, ""
+	}
+	if cast.snapshotSeq != seq+1 {
+		key := cast.frames.At(seq)
+		data := make([]byte, 0, len(cast.joinHeader)+len(cast.joinTracks)+len(key.cluster)+len(key.buf))
+		data = append(data, cast.joinHeader...)
+		data = append(data, cast.joinTracks...)
+		data = append(data, key.cluster...)
+		data = append(data, key.buf...)
+		// Sequence numbers restart if the stream is recreated, so timecodes are in there too.
+		cast.snapshot = data
+		cast.snapshotSeq = seq + 1
+		cast.snapshotTag = `"` + strconv.FormatUint(key.timecode, 36) + "-" + strconv.FormatUint(seq, 36) + `"`
+	}
+	return cast.snapshot, cast.snapshotTag
+}
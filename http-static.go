@@ -0,0 +1,139 @@
+// GET /static/<path>
+//     Files from `static/`. These are loaded into memory at startup (and on SIGHUP)
+//     along with a gzipped copy. `{{static "/static/<path>"}}` in templates gives
+//     a fingerprinted URL that can be cached forever.
+//
+package main
+
+import (
+	"bytes"
+	"compress/gzip"
+	"crypto/sha1"
+	"encoding/hex"
+	"io/ioutil"
+	"mime"
+	"net/http"
+	"os"
+	"path"
+	"path/filepath"
+	"strings"
+	"sync"
+	"time"
+)
+
+type staticAsset struct {
+	ctype   string
+	data    []byte
+	gzipped []byte // nil if compression does not help
+	etag    string
+}
+
+type staticSet struct {
+	root string
+	// If set, files are always served from disk and URLs are not fingerprinted.
+	AutoReload bool
+	// Serves whatever is not in memory, e.g. recordings.
+	Fallback http.Handler
+	lock     sync.RWMutex
+	files    map[string]*staticAsset // by both plain and fingerprinted URL
+	urls     map[string]string       // plain URL -> fingerprinted URL
+}
+
+// Larger files are left to `Fallback`.
+const staticAssetMaxSize = 1024 * 1024
+
+var staticFiles = &staticSet{root: "static"}
+
+func (ss *staticSet) Reload() error {
+	files := make(map[string]*staticAsset)
+	urls := make(map[string]string)
+	err := filepath.Walk(ss.root, func(p string, info os.FileInfo, err error) error {
+		if err != nil {
+			return err
+		}
+		if info.IsDir() {
+			if p == recordingDir {
+				return filepath.SkipDir
+			}
+			return nil
+		}
+		if !info.Mode().IsRegular() || info.Size() > staticAssetMaxSize {
+			return nil
+		}
+		data, err := ioutil.ReadFile(p)
+		if err != nil {
+			return err
+		}
+		hash := sha1.Sum(data)
+		sum := hex.EncodeToString(hash[:8])
+		asset := &staticAsset{ctype: mime.TypeByExtension(filepath.Ext(p)), data: data, etag: `"` + sum + `"`}
+		if asset.ctype == "" {
+			// `http.ServeContent` would sniff the gzipped copy instead.
+			asset.ctype = http.DetectContentType(data)
+		}
+		gz := bytes.Buffer{}
+		zw, _ := gzip.NewWriterLevel(&gz, gzip.BestCompression)
+		zw.Write(data)
+		zw.Close()
+		if gz.Len() < len(data)*9/10 {
+			asset.gzipped = gz.Bytes()
+		}
+		url := "/" + filepath.ToSlash(p)
+		ext := path.Ext(url)
+		fingerprinted := url[:len(url)-len(ext)] + "." + sum + ext
+		files[url] = asset
+		files[fingerprinted] = asset
+		urls[url] = fingerprinted
+		return nil
+	})
+	if err != nil {
+		return err
+	}
+	ss.lock.Lock()
+	ss.files, ss.urls = files, urls
+	ss.lock.Unlock()
+	return nil
+}
+
+// The URL to refer to a static file by in pages.
+func (ss *staticSet) URL(url string) string {
+	if ss.AutoReload {
+		return url
+	}
+	ss.lock.RLock()
+	defer ss.lock.RUnlock()
+	if fingerprinted, ok := ss.urls[url]; ok {
+		return fingerprinted
+	}
+	return url
+}
+
+func (ss *staticSet) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	ss.lock.RLock()
+	asset, ok := ss.files[r.URL.Path]
+	_, plain := ss.urls[r.URL.Path]
+	ss.lock.RUnlock()
+	if !ok || ss.AutoReload || (r.Method != "GET" && r.Method != "HEAD") {
+		ss.Fallback.ServeHTTP(w, r)
+		return
+	}
+
+	header := w.Header()
+	if plain {
+		header.Set("Cache-Control", "no-cache")
+	} else {
+		header.Set("Cache-Control", "public, max-age=31536000, immutable")
+	}
+	data, etag := asset.data, asset.etag
+	if asset.gzipped != nil {
+		header.Set("Vary", "Accept-Encoding")
+		if strings.Contains(r.Header.Get("Accept-Encoding"), "gzip") {
+			// A different representation needs a different strong ETag.
+			data, etag = asset.gzipped, etag[:len(etag)-1]+`-gz"`
+			header.Set("Content-Encoding", "gzip")
+		}
+	}
+	header.Set("Content-Type", asset.ctype)
+	header.Set("ETag", etag)
+	http.ServeContent(w, r, "", time.Time{}, bytes.NewReader(data))
+}
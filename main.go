@@ -7,6 +7,8 @@ import (
 	"math/rand"
 	"net/http"
 	"os"
+	"os/signal"
+	"syscall"
 	"time"
 )
 
@@ -48,6 +50,14 @@ func main() {
 	rand.Seed(time.Now().UTC().UnixNano())
 	bind := flag.String("bind", ":8000", "The network ([ip]:port) to bind on.")
 	addr := flag.String("addr", "", "The public address (host[:port]) of this node.")
+	flush := flag.Duration("flush-interval", 5*time.Millisecond, "How long to batch frames for before sending them to a viewer.")
+	trace := flag.Float64("trace-sampling", 0, "The fraction of frames to measure ingest-to-viewer latency for, e.g. 0.01.")
+	relay := flag.Bool("relay", false, "Serve viewers of streams on other nodes through this one instead of redirecting them.")
+	balance := flag.Bool("balance", false, "Send new broadcasters to the least loaded node. Only makes sense with -addr.")
+	maxIngest := flag.Float64("max-ingest", 0, "Turn away new broadcasters while receiving this many Mbit/s in total. 0 for no limit.")
+	maxViewers := flag.Int("max-viewers", 0, "Turn away viewers over this many. 0 for no limit.")
+	maxMemory := flag.Int64("max-memory", 0, "Turn away new clients while buffering this many MiB of frames. 0 for no limit.")
+	reload := flag.Bool("reload", false, "Reload templates and static files when they change instead of only on SIGHUP. For development.")
 	ephemeral := flag.Bool("ephemeral", false, "Use a process-local in-memory userless database. Can only be enabled in joint mode.")
 	flag.Parse()
 
@@ -56,9 +66,17 @@ func main() {
 	}
 
 	ctx := Context{
-		Database:        NewAnonDatabase(),
-		SecureKey:       []byte("12345678901234567890123456789012"),
-		StreamKeepAlive: 20 * time.Second,
+		Database:            NewAnonDatabase(),
+		SecureKey:           []byte("12345678901234567890123456789012"),
+		StreamKeepAlive:     20 * time.Second,
+		StreamBufferSize:    16 * 1024 * 1024,
+		StreamFlushInterval: *flush,
+		StreamRelay:         *relay,
+		StreamBalance:       *balance,
+		StreamTraceSampling: *trace,
+		MaxIngestRate:       *maxIngest * 1000000 / 8,
+		MaxViewers:          *maxViewers,
+		MaxBufferMemory:     *maxMemory * 1024 * 1024,
 	}
 	if !*ephemeral {
 		var err error
@@ -67,9 +85,58 @@ func main() {
 		}
 	}
 
+	templates.AutoReload = *reload
+	if err := templates.Reload(); err != nil {
+		log.Fatal("Could not load templates: ", err)
+	}
+	staticFiles.AutoReload = *reload
+	staticFiles.Fallback = http.FileServer(disallowDirectoryListing("."))
+	if err := staticFiles.Reload(); err != nil {
+		log.Fatal("Could not load static files: ", err)
+	}
+	listener, state, err := listen(*bind)
+	if err != nil {
+		log.Fatal("Could not listen: ", err)
+	}
+
 	mux := http.NewServeMux()
-	mux.Handle("/static/", http.FileServer(disallowDirectoryListing(".")))
-	mux.Handle("/stream/", UnsafeHandler{NewRetransmissionHandler(&ctx)})
+	mux.Handle("/static/", staticFiles)
+	streams := NewRetransmissionHandler(&ctx)
+	mux.Handle("/stream/", UnsafeHandler{streams})
+	mux.Handle("/metrics", UnsafeHandler{MetricsHandler{streams}})
+	mux.Handle("/snapshot/", UnsafeHandler{SnapshotHandler{streams}})
 	mux.Handle("/", UnsafeHandler{NewUIHandler(&ctx)})
-	log.Fatal(http.ListenAndServe(*bind, mux))
+	streams.Adopt(state)
+	srv := &http.Server{Handler: mux}
+
+	drained := make(chan struct{})
+	signals := make(chan os.Signal, 1)
+	signal.Notify(signals, syscall.SIGHUP, syscall.SIGUSR2)
+	go func() {
+		for sig := range signals {
+			if sig == syscall.SIGUSR2 {
+				done, err := streams.Handoff(srv, listener)
+				if err != nil {
+					log.Println("Could not restart: ", err)
+					continue
+				}
+				<-done
+				close(drained)
+				return
+			}
+			if err := templates.Reload(); err != nil {
+				log.Println("Error reloading templates: ", err)
+			}
+			if err := staticFiles.Reload(); err != nil {
+				log.Println("Error reloading static files: ", err)
+			}
+		}
+	}()
+	if err = srv.Serve(listener); err != http.ErrServerClosed {
+		log.Fatal(err)
+	}
+	<-drained
+	if err = ctx.Database.Close(); err != nil {
+		log.Println("Error closing the database: ", err)
+	}
 }
@@ -0,0 +1,208 @@
+// GET /metrics
+//     Node and per-stream statistics in the Prometheus text format.
+//
+package main
+
+import (
+	"database/sql"
+	"fmt"
+	"io"
+	"net/http"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Process-wide counters. These are only ever incremented, so they can be updated
+// from anywhere without locking; the rates are for whatever scrapes them to compute.
+var metrics struct {
+	ingestBytes uint64
+	resyncs     uint64
+	chatEvents  uint64
+	chatDropped uint64
+	// For sampled blocks: from the start of the `Broadcast.Write` that completed the block
+	// to it being pushed into the stream's buffer; from then to a viewer reading it;
+	// and from then to the viewer's socket write returning.
+	traceIngest   histogram
+	traceQueue    histogram
+	traceSend     histogram
+	parseErrorsMu sync.Mutex
+	parseErrors   map[string]uint64
+}
+
+func countParseError(err error) {
+	metrics.parseErrorsMu.Lock()
+	if metrics.parseErrors == nil {
+		metrics.parseErrors = make(map[string]uint64)
+	}
+	metrics.parseErrors[err.Error()]++
+	metrics.parseErrorsMu.Unlock()
+}
+
+// Upper bounds, in seconds, of the buckets used for all latency histograms.
+var histogramBuckets = [...]float64{.0001, .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1}
+
+type histogram struct {
+	counts [len(histogramBuckets) + 1]uint64
+	sum    uint64 // nanoseconds
+}
+
+func (h *histogram) Observe(d time.Duration) {
+	i := sort.SearchFloat64s(histogramBuckets[:], d.Seconds())
+	atomic.AddUint64(&h.counts[i], 1)
+	atomic.AddUint64(&h.sum, uint64(d))
+}
+
+func (h *histogram) WriteTo(w io.Writer, name string, labels string) {
+	total := uint64(0)
+	for i, bound := range histogramBuckets {
+		total += atomic.LoadUint64(&h.counts[i])
+		fmt.Fprintf(w, "%s_bucket{%sle=\"%g\"} %d\n", name, labels, bound, total)
+	}
+	total += atomic.LoadUint64(&h.counts[len(histogramBuckets)])
+	fmt.Fprintf(w, "%s_bucket{%sle=\"+Inf\"} %d\n", name, labels, total)
+	if labels != "" {
+		labels = "{" + labels[:len(labels)-1] + "}"
+	}
+	fmt.Fprintf(w, "%s_sum%s %g\n", name, labels, time.Duration(atomic.LoadUint64(&h.sum)).Seconds())
+	fmt.Fprintf(w, "%s_count%s %d\n", name, labels, total)
+}
+
+// A prepared statement that keeps track of how long it takes to execute.
+type timedStmt struct {
+	latency histogram // first, so that its counters are aligned for atomic access
+	*sql.Stmt
+}
+
+func (s *timedStmt) Exec(args ...interface{}) (sql.Result, error) {
+	start := time.Now()
+	r, err := s.Stmt.Exec(args...)
+	s.latency.Observe(time.Since(start))
+	return r, err
+}
+
+func (s *timedStmt) Query(args ...interface{}) (*sql.Rows, error) {
+	start := time.Now()
+	r, err := s.Stmt.Query(args...)
+	s.latency.Observe(time.Since(start))
+	return r, err
+}
+
+func (s *timedStmt) QueryRow(args ...interface{}) *sql.Row {
+	start := time.Now()
+	r := s.Stmt.QueryRow(args...)
+	s.latency.Observe(time.Since(start))
+	return r
+}
+
+type metricsWriter interface {
+	WriteMetrics(w io.Writer)
+}
+
+type MetricsHandler struct {
+	*RetransmissionHandler
+}
+
+func (ctx MetricsHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) error {
+	if r.Method != "GET" {
+		return RenderInvalidMethod(w, "GET")
+	}
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	w.Header().Set("Cache-Control", "no-cache")
+
+	fmt.Fprintf(w, "# TYPE webmcast_ingest_bytes_total counter\nwebmcast_ingest_bytes_total %d\n", atomic.LoadUint64(&metrics.ingestBytes))
+	fmt.Fprintf(w, "# TYPE webmcast_viewer_resyncs_total counter\nwebmcast_viewer_resyncs_total %d\n", atomic.LoadUint64(&metrics.resyncs))
+	fmt.Fprintf(w, "# TYPE webmcast_chat_events_total counter\nwebmcast_chat_events_total %d\n", atomic.LoadUint64(&metrics.chatEvents))
+	fmt.Fprintf(w, "# TYPE webmcast_chat_dropped_total counter\nwebmcast_chat_dropped_total %d\n", atomic.LoadUint64(&metrics.chatDropped))
+	io.WriteString(w, "# TYPE webmcast_parse_errors_total counter\n")
+	metrics.parseErrorsMu.Lock()
+	for e, n := range metrics.parseErrors {
+		fmt.Fprintf(w, "webmcast_parse_errors_total{error=%s} %d\n", strconv.Quote(e), n)
+	}
+	metrics.parseErrorsMu.Unlock()
+	if ctx.TraceEvery != 0 {
+		io.WriteString(w, "# TYPE webmcast_trace_seconds histogram\n")
+		metrics.traceIngest.WriteTo(w, "webmcast_trace_seconds", "stage=\"ingest\",")
+		metrics.traceQueue.WriteTo(w, "webmcast_trace_seconds", "stage=\"queue\",")
+		metrics.traceSend.WriteTo(w, "webmcast_trace_seconds", "stage=\"send\",")
+	}
+
+	u := ctx.Usage()
+	fmt.Fprintf(w, "# TYPE webmcast_ingest_bytes_per_second gauge\nwebmcast_ingest_bytes_per_second %g\n", u.Ingest)
+	fmt.Fprintf(w, "# TYPE webmcast_viewers gauge\nwebmcast_viewers %d\n", u.Viewers)
+	fmt.Fprintf(w, "# TYPE webmcast_memory_bytes gauge\nwebmcast_memory_bytes %d\n", u.Memory())
+	io.WriteString(w, "# TYPE webmcast_limit gauge\n")
+	if ctx.MaxIngestRate != 0 {
+		fmt.Fprintf(w, "webmcast_limit{resource=\"ingest_bytes_per_second\"} %g\n", ctx.MaxIngestRate)
+	}
+	if ctx.MaxViewers != 0 {
+		fmt.Fprintf(w, "webmcast_limit{resource=\"viewers\"} %d\n", ctx.MaxViewers)
+	}
+	if ctx.MaxBufferMemory != 0 {
+		fmt.Fprintf(w, "webmcast_limit{resource=\"memory_bytes\"} %d\n", ctx.MaxBufferMemory)
+	}
+
+	io.WriteString(w, "# TYPE webmcast_stream_ingest_bytes_per_second gauge\n")
+	io.WriteString(w, "# TYPE webmcast_stream_viewers gauge\n")
+	io.WriteString(w, "# TYPE webmcast_stream_viewer_lag_frames_sum gauge\n")
+	io.WriteString(w, "# TYPE webmcast_stream_viewer_lag_frames_max gauge\n")
+	io.WriteString(w, "# TYPE webmcast_stream_viewer_lag_seconds_max gauge\n")
+	ctx.Streams(func(id string, cast *Broadcast) {
+		mean, _ := cast.Rate()
+		lag := cast.Lag()
+		label := strconv.Quote(id)
+		fmt.Fprintf(w, "webmcast_stream_ingest_bytes_per_second{stream=%s} %g\n", label, mean)
+		fmt.Fprintf(w, "webmcast_stream_viewers{stream=%s} %d\n", label, lag.Viewers)
+		fmt.Fprintf(w, "webmcast_stream_viewer_lag_frames_sum{stream=%s} %d\n", label, lag.Frames)
+		fmt.Fprintf(w, "webmcast_stream_viewer_lag_frames_max{stream=%s} %d\n", label, lag.MaxFrames)
+		fmt.Fprintf(w, "webmcast_stream_viewer_lag_seconds_max{stream=%s} %g\n", label, float64(lag.MaxTimecode)/1000)
+	})
+
+	if db, ok := ctx.Database.(metricsWriter); ok {
+		db.WriteMetrics(w)
+	}
+	return nil
+}
+
+// Call a function for each stream. The function must not access the set.
+func (ctx *BroadcastSet) Streams(f func(id string, cast *Broadcast)) {
+	for i := range ctx.shards {
+		shard := &ctx.shards[i]
+		shard.RLock()
+		for id, cast := range shard.streams {
+			f(id, cast)
+		}
+		shard.RUnlock()
+	}
+}
+
+type broadcastLag struct {
+	Viewers int
+	// How many frames the viewers have yet to read, in total and at most.
+	Frames    uint64
+	MaxFrames uint64
+	// How far behind the last frame pushed is the last frame read, in milliseconds.
+	MaxTimecode uint64
+}
+
+func (cast *Broadcast) Lag() (r broadcastLag) {
+	// Viewers advance their cursors while holding a read lock.
+	cast.vlock.Lock()
+	defer cast.vlock.Unlock()
+	fb := &cast.frames
+	for cb := range cast.viewers {
+		lag := fb.next - cb.cursor
+		if r.Frames += lag; lag > r.MaxFrames {
+			r.MaxFrames = lag
+		}
+		if lag != 0 && fb.next != fb.first {
+			if t := fb.At(fb.next - 1).timecode; t > cb.timecode && t-cb.timecode > r.MaxTimecode {
+				r.MaxTimecode = t - cb.timecode
+			}
+		}
+	}
+	r.Viewers = len(cast.viewers)
+	return r
+}
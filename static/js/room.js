@@ -50,7 +50,10 @@ RPC.prototype.open = function (url) {
     if (this.socket)
         this.socket.close();
     this.socket = new WebSocket(this.url = url);
+    this.socket.binaryType = 'arraybuffer';
     this.socket.onmessage = ev => {
+        if (typeof ev.data !== 'string')
+            return this.emit('RPC.Binary', ev.data);
         let msg = JSON.parse(ev.data);
         if (msg.method)
             this.emit(msg.method, ...msg.params);
@@ -112,14 +115,71 @@ let withRPC = rpc => ({
     },
 
     '.player'(e) {
+        // if possible, the media comes over the same socket; see `Stream.Watch`.
+        let media = null;
+        let append = _ => {
+            if (!media || !media.buffer || media.buffer.updating || !media.queue.length)
+                return;
+            let data = media.queue.shift();
+            if (data === null)
+                return media.source.readyState === 'open' && media.source.endOfStream();
+            media.buffer.appendBuffer(data);
+        };
+        // when falling back to plain HTTP, so that the server doesn't send everything twice.
+        let unwatch = _ => rpc.send('Stream.Unwatch').catch(_ => {});
+
+        $.observeData(e, 'src', '', src => {
+            if (!media || !src || src !== e.dataset.httpSrc)
+                return;
+            // restarted over plain HTTP, see `.play`. if `Stream.Watch` has not
+            // returned yet, it will be undone when it does.
+            if (media.type)
+                unwatch();
+            media = null;
+        });
+        rpc.on('RPC.Binary', data => {
+            if (media)
+                media.queue.push(data), append();
+        });
+        rpc.on('Stream.Ended', _ => {
+            if (media)
+                media.queue.push(null), append();
+        });
         rpc.on(RPC.STATE_INIT, _ => e.dataset.status = 'loading');
         rpc.on(RPC.STATE_OPEN, _ => {
             // TODO measure connection speed, request a stream
-            e.dataset.src = rpc.url.replace('ws', 'http');
+            e.dataset.httpSrc = rpc.url.replace('ws', 'http');
             e.dataset.live = '1';
+            if (!window.MediaSource)
+                return e.dataset.src = e.dataset.httpSrc;
+            // the first message may arrive before the response.
+            media = { type: null, source: null, buffer: null, queue: [] };
+            rpc.send('Stream.Watch').then(type => {
+                if (!media)
+                    return unwatch();
+                if (!MediaSource.isTypeSupported(type)) {
+                    media = null;
+                    unwatch();
+                    return e.dataset.src = e.dataset.httpSrc;
+                }
+                media.type = type;
+                let source = media.source = new MediaSource();
+                source.addEventListener('sourceopen', _ => {
+                    if (!media || media.source !== source || media.buffer)
+                        return;
+                    media.buffer = source.addSourceBuffer(type);
+                    media.buffer.addEventListener('updateend', append);
+                    append();
+                });
+                e.dataset.src = URL.createObjectURL(source);
+            }, _ => {
+                media = null;
+                e.dataset.src = e.dataset.httpSrc;
+            });
         });
         rpc.on(RPC.STATE_CLOSED, _ => {
             if (e.dataset.live) delete e.dataset.live;
+            media = null;
             e.dataset.src = '';
         });
     },
@@ -181,6 +241,10 @@ let withRPC = rpc => ({
             m.appendChild(textSpan);
             log.appendChild(m);
         }));
+        rpc.on('Chat.History', msgs => {
+            for (let [name, text, login] of msgs)
+                rpc.emit('Chat.Message', name, text, login);
+        });
         rpc.on('Chat.AcquiredName', autoscroll((name, login) => {
             e.classList.add('logged-in');
             e.querySelector('.input-form textarea').select();
@@ -289,7 +353,8 @@ $.extend({
 
         e.button('.play', _ => {
             if (e.dataset.live)
-                e.dataset.src = e.dataset.src;
+                // a MediaSource can't be reattached to the stream after stopping.
+                e.dataset.src = e.dataset.httpSrc || e.dataset.src;
             else
                 ignoreErrors(video.play());
         });
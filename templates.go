@@ -4,18 +4,23 @@ import (
 	"bytes"
 	"fmt"
 	"html/template"
+	"io/ioutil"
 	"net/http"
 	"os"
 	"path/filepath"
 	"reflect"
 	"regexp"
+	"sync"
 	"time"
 )
 
 type templateSet struct {
-	root  string
-	data  *template.Template
-	mtime time.Time
+	root string
+	// If set, templates are reparsed when modified. Otherwise, only by `Reload`.
+	AutoReload bool
+	lock       sync.RWMutex
+	data       *template.Template
+	mtime      time.Time
 }
 
 type viewmodel interface {
@@ -36,34 +41,87 @@ var templateFuncs = template.FuncMap{
 		}
 		return rv.FieldByName(name).IsValid()
 	},
+	"static": func(url string) string {
+		return staticFiles.URL(url)
+	},
 }
 
-var htmlInterElementWhitespace = regexp.MustCompile(">\\s+<")
+// Whitespace between tags, and between tags and actions, is collapsed in the source
+// rather than the output. (Nothing that is rendered from data is affected anyway.)
+var htmlInterElementWhitespace = regexp.MustCompile("(>|}})\\s+(<|{{)")
+
+// Buffers larger than this are not reused so that one huge page does not stay in memory.
+const templateBufferMaxSize = 64 * 1024
+
+var templateBuffers = sync.Pool{New: func() interface{} { return &bytes.Buffer{} }}
+
+// Parse all templates again, e.g. on SIGHUP.
+func (ts *templateSet) Reload() error {
+	_, err := ts.load()
+	return err
+}
+
+func (ts *templateSet) load() (*template.Template, error) {
+	paths, err := filepath.Glob(filepath.Join(ts.root, "*"))
+	if err != nil {
+		return nil, err
+	}
+	mtime := time.Now()
+	data := template.New(ts.root).Funcs(templateFuncs)
+	for _, path := range paths {
+		src, err := ioutil.ReadFile(path)
+		if err != nil {
+			return nil, err
+		}
+		src = htmlInterElementWhitespace.ReplaceAll(src, []byte("$1 $2"))
+		if _, err = data.New(filepath.Base(path)).Parse(string(src)); err != nil {
+			return nil, err
+		}
+	}
+	ts.lock.Lock()
+	ts.data, ts.mtime = data, mtime
+	ts.lock.Unlock()
+	return data, nil
+}
 
 func (ts *templateSet) Render(w http.ResponseWriter, code int, vm viewmodel) error {
 	name := vm.TemplateFile()
-	stat, err := os.Stat(filepath.Join(ts.root, name))
-	if ts.data == nil || (err == nil && stat.ModTime().After(ts.mtime)) {
-		ts.data, err = template.New(ts.root).Funcs(templateFuncs).ParseGlob(filepath.Join(ts.root, "*"))
-		if err != nil {
+	ts.lock.RLock()
+	data, mtime := ts.data, ts.mtime
+	ts.lock.RUnlock()
+	if data == nil || (ts.AutoReload && ts.modifiedSince(name, mtime)) {
+		var err error
+		if data, err = ts.load(); err != nil {
 			return err
 		}
-		ts.mtime = time.Now()
 	}
-	if t := ts.data.Lookup(name); t != nil {
-		buf := &bytes.Buffer{}
-		if err = t.Execute(buf, vm); err != nil {
+	if t := data.Lookup(name); t != nil {
+		buf := templateBuffers.Get().(*bytes.Buffer)
+		defer func() {
+			if buf.Cap() <= templateBufferMaxSize {
+				buf.Reset()
+				templateBuffers.Put(buf)
+			}
+		}()
+		if err := t.Execute(buf, vm); err != nil {
 			return err
 		}
 		w.Header().Set("Content-Type", "text/html; encoding=utf-8")
 		w.WriteHeader(code)
-		w.Write(htmlInterElementWhitespace.ReplaceAll(buf.Bytes(), []byte("> <")))
+		w.Write(buf.Bytes())
 		return nil
 	}
 	return fmt.Errorf("template not found: %s", name)
 }
 
-var Render = (&templateSet{root: "templates"}).Render
+func (ts *templateSet) modifiedSince(name string, t time.Time) bool {
+	stat, err := os.Stat(filepath.Join(ts.root, name))
+	return err == nil && stat.ModTime().After(t)
+}
+
+var templates = &templateSet{root: "templates"}
+
+var Render = templates.Render
 
 type ErrorTemplate struct {
 	Code    int
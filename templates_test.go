@@ -0,0 +1,44 @@
+package main
+
+import (
+	"net/http"
+	"testing"
+)
+
+type discardResponse http.Header
+
+func (w discardResponse) Header() http.Header {
+	return http.Header(w)
+}
+
+func (w discardResponse) Write(data []byte) (int, error) {
+	return len(data), nil
+}
+
+func (w discardResponse) WriteHeader(int) {
+}
+
+// A room page as served in production, i.e. with templates and static files loaded
+// once at startup.
+func BenchmarkRenderRoom(b *testing.B) {
+	if err := templates.Reload(); err != nil {
+		b.Fatal(err)
+	}
+	if err := staticFiles.Reload(); err != nil {
+		b.Fatal(err)
+	}
+	room := Room{ID: "bench", Online: true, Meta: &StreamMetadata{
+		UserName:        "bench",
+		Name:            "Benchmark",
+		Email:           "bench@example.com",
+		StreamTrackInfo: StreamTrackInfo{HasVideo: true, HasAudio: true, Width: 1280, Height: 720},
+	}}
+	w := discardResponse{}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := templates.Render(w, http.StatusOK, room); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -9,6 +9,9 @@ func ValidateUsername(name string) error {
 	if len(name) == 0 || len(name) > 32 {
 		return ErrInvalidUsername
 	}
+	if _, n := splitRendition(name); n != -1 {
+		return ErrInvalidUsername // would be confused with a stream's rendition
+	}
 	for _, c := range name {
 		if !unicode.IsGraphic(c) {
 			return ErrInvalidUsername